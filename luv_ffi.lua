@@ -0,0 +1,119 @@
+--
+-- LuaJIT FFI binding to uhttp messages and responses.
+-- Talks to the stable accessor functions of luv.so, so that handlers
+-- inspect requests and emit responses without the classic Lua C API.
+--
+--   local F = require('luv_ffi')
+--   LUV.make_server(8080, '0.0.0.0', 128, function (handle, ev)
+--     if ev == LUV.END then
+--       local msg = F.msg(handle)
+--       F.send(msg, 200, 'Hello\n', 'Content-Type: text/plain\r\n')
+--     end
+--   end)
+--
+
+local ffi = require('ffi')
+
+ffi.cdef[[
+typedef struct msg_s msg_t;
+
+const char *msg_method(const msg_t *msg);
+const char *msg_url(const msg_t *msg, size_t *len);
+int msg_keep_alive(const msg_t *msg);
+size_t msg_nheaders(const msg_t *msg);
+const char *msg_header_name(const msg_t *msg, size_t i, size_t *len);
+const char *msg_header_value(const msg_t *msg, size_t i, size_t *len);
+const char *msg_header_get(const msg_t *msg, const char *name,
+    size_t name_len, size_t *len);
+
+void response_write_status(msg_t *self, int code);
+void response_write_date(msg_t *self);
+int response_write_copy(msg_t *self, const char *data, size_t len);
+void response_end(msg_t *self);
+]]
+
+-- N.B. luv.so is loaded by require() with local symbols, so load it
+-- once more to resolve them. the host may as well export them itself
+local function find_library(name)
+  for pattern in package.cpath:gmatch('[^;]+') do
+    local path = pattern:gsub('%?', name)
+    local f = io.open(path)
+    if f then
+      f:close()
+      return path
+    end
+  end
+end
+
+local C = ffi.C
+if not pcall(function () return C.msg_method end) then
+  C = ffi.load(assert(find_library('luv'), 'luv.so not found'))
+end
+
+local cast, str = ffi.cast, ffi.string
+local len = ffi.new('size_t[1]')
+
+local M = { }
+
+-- message handle passed to event handler
+function M.msg(handle)
+  return cast('msg_t *', handle)
+end
+
+function M.method(msg)
+  return str(C.msg_method(msg))
+end
+
+function M.url(msg)
+  local p = C.msg_url(msg, len)
+  return str(p, len[0])
+end
+
+function M.keep_alive(msg)
+  return C.msg_keep_alive(msg) ~= 0
+end
+
+-- value of request header, nil if absent. name should be lower cased
+function M.header(msg, name)
+  local p = C.msg_header_get(msg, name, #name, len)
+  if p ~= nil then
+    return str(p, len[0])
+  end
+end
+
+-- iterate over request headers
+function M.headers(msg)
+  local i, n = -1, tonumber(C.msg_nheaders(msg))
+  return function ()
+    i = i + 1
+    if i >= n then return end
+    local name = str(C.msg_header_name(msg, i, len), len[0])
+    return name, str(C.msg_header_value(msg, i, len), len[0])
+  end
+end
+
+-- N.B. data is copied, so the string need not be kept alive
+function M.write(msg, data)
+  C.response_write_copy(msg, data, #data)
+end
+
+function M.finish(msg)
+  C.response_end(msg)
+end
+
+-- send complete response.
+-- headers is an optional string of serialized header lines
+function M.send(msg, code, body, headers)
+  body = body or ''
+  C.response_write_status(msg, code)
+  C.response_write_date(msg)
+  if headers then
+    C.response_write_copy(msg, headers, #headers)
+  end
+  local cl = 'Content-Length: ' .. #body .. '\r\n\r\n'
+  C.response_write_copy(msg, cl, #cl)
+  C.response_write_copy(msg, body, #body)
+  C.response_end(msg)
+end
+
+return M
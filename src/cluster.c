@@ -1,74 +1,163 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
-static pid_t helper_pid[8];
+#include "common.h"
+#include "cluster.h"
+
+// max number of workers
+#define MAX_WORKERS 256
+
+// respawn of a worker died earlier than this is delayed, seconds
+#define MIN_WORKER_LIFETIME 1
+
+typedef struct {
+  pid_t pid;
+  time_t started;
+} worker_t;
+
+static worker_t workers[MAX_WORKERS];
+static int nworkers = 0;
+static volatile sig_atomic_t stopping = 0;
 
 static pid_t safe_waitpid(pid_t pid, int *wstat, int options)
 {
   pid_t r;
   do
     r = waitpid(pid, wstat, options);
-  while ((r == -1) && (errno == EINTR));
+  while ((r == -1) && (errno == EINTR) && !stopping);
   return r;
 }
 
-static void kill_helpers()
+static void kill_workers(int signo)
 {
-  if (helper_pid > 0) {
-    kill(helper_pid, SIGTERM);
-    helper_pid = 0;
+  int i;
+  for (i = 0; i < nworkers; ++i) {
+    if (workers[i].pid > 0) kill(workers[i].pid, signo);
   }
 }
 
+// SIGTERM, SIGINT. forward to workers and wait for them to exit
 static void signal_handler(int signo)
 {
-  // SIGCHLD. reap zombies
-  if (safe_waitpid(helper_pid, &err, WNOHANG) > 0) {
-    if (WIFSIGNALED(err))
-      DIE("helper killed by signal %u", WTERMSIG(err));
-    if (WIFEXITED(err)) {
-      helper_pid = 0;
-      if (WEXITSTATUS(err))
-        DIE("helper exited (%u)", WEXITSTATUS(err));
-    }
+  stopping = 1;
+  kill_workers(SIGTERM);
+}
+
+// fork a worker to occupy the slot. returns 0 in the worker
+static pid_t launch_worker(int i)
+{
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return pid;
+  }
+  // worker
+  if (pid == 0) {
+    // worker goes away with the master
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    return 0;
   }
+  // master
+  workers[i].pid = pid;
+  workers[i].started = time(NULL);
+  DEBUGF("WORKER %d STARTED %d", i + 1, pid);
+  return pid;
 }
 
-static void launch_helper(const char **argv)
+int cluster_bind(const char *host, int port, int backlog_size)
 {
-  // setup vanilla unidirectional pipes interchange
-  int i;
-  int pipes[4];
-
-  if (pipe(pipes) == -1 || pipe(pipes + 2) == -1)
-    DIE("pipe");
-
-  // NB: handler must be installed before vfork
-  bb_signals(0
-    + (1 << SIGCHLD)
-    + (1 << SIGALRM)
-    , signal_handler);
-
-  helper_pid = xvfork();
-
-  i = (!helper_pid) * 2;   // for parent:0, for child:2
-  close(pipes[i + 1]);     // 1 or 3 - closing one write end
-  close(pipes[2 - i]);     // 2 or 0 - closing one read end
-  xmove_fd(pipes[i], STDIN_FILENO);      // 0 or 2 - using other read end
-  xmove_fd(pipes[3 - i], STDOUT_FILENO); // 3 or 1 - using other write end
-  // End result:
-  // parent stdout [3] -> child stdin [2]
-  // child stdout [1] -> parent stdin [0]
-
-	if (!G.helper_pid) {
-		// child: try to execute connection helper
-		// NB: SIGCHLD & SIGALRM revert to SIG_DFL on exec
-		BB_EXECVP_or_die((char**)argv);
-	}
-
-	// parent
-	// check whether child is alive
-	//redundant:signal_handler(SIGCHLD);
-	// child seems OK -> parent goes on
-	atexit(kill_helper);
+  struct sockaddr_in address;
+  int on = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    exit(-1);
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  // N.B. workers race to accept on the shared socket. blocking socket
+  // would leave losers stuck in accept()
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)
+      || fcntl(fd, F_SETFD, FD_CLOEXEC))
+  {
+    perror("fcntl");
+    exit(-1);
+  }
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = inet_addr(host);
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address))) {
+    perror("bind");
+    exit(-1);
+  }
+  if (listen(fd, backlog_size)) {
+    perror("listen");
+    exit(-1);
+  }
+  return fd;
 }
 
+// N.B. call before the event loop of the master is used, so that workers
+// do not inherit its state. anything loaded so far (the Lua state included)
+// is shared with workers copy-on-write
+int cluster_fork(int n)
+{
+  int i, status;
+  pid_t pid;
+
+  assert(n > 0 && n <= MAX_WORKERS);
+  nworkers = n;
+
+  signal(SIGTERM, signal_handler);
+  signal(SIGINT, signal_handler);
+  // N.B. let libuv catch EPIPE in workers
+  signal(SIGPIPE, SIG_IGN);
+
+  for (i = 0; i < nworkers; ++i) {
+    if (launch_worker(i) == 0) return i + 1;
+  }
+
+  // master: reap and respawn workers
+  while (!stopping) {
+    pid = safe_waitpid(-1, &status, 0);
+    if (pid <= 0) continue;
+    for (i = 0; i < nworkers; ++i) if (workers[i].pid == pid) break;
+    if (i == nworkers) continue;
+    workers[i].pid = 0;
+    if (stopping) break;
+    if (WIFSIGNALED(status)) {
+      fprintf(stderr, "worker %d killed by signal %d\n",
+          i + 1, WTERMSIG(status));
+    } else if (WIFEXITED(status)) {
+      fprintf(stderr, "worker %d exited (%d)\n",
+          i + 1, WEXITSTATUS(status));
+    }
+    // do not spin if workers die at once
+    if (time(NULL) - workers[i].started < MIN_WORKER_LIFETIME) {
+      sleep(MIN_WORKER_LIFETIME);
+    }
+    if (launch_worker(i) == 0) return i + 1;
+  }
+
+  // master is stopping: wait for workers to exit
+  stopping = 1;
+  kill_workers(SIGTERM);
+  while (waitpid(-1, &status, 0) > 0 || errno == EINTR);
+  exit(0);
+}
@@ -0,0 +1,11 @@
+#ifndef _LUV_CLUSTER_H
+#define _LUV_CLUSTER_H
+
+// bind and listen to the address, return the socket to be shared by workers
+int cluster_bind(const char *host, int port, int backlog_size);
+
+// fork nworkers workers and babysit them.
+// returns 1-based worker index in the worker, never returns in the master
+int cluster_fork(int nworkers);
+
+#endif
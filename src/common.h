@@ -25,7 +25,15 @@ enum event_t {
   EVT_MAX
 };
 
-#define EVENT(self, params...) (self)->on_event((self), params)
+#define EVENT_MASK(ev) (1u << (ev))
+#define EVENT_ALL (~0u)
+
+// fire event if subscribed to
+#define EVENT(self, msg, ev, params...) do { \
+    if ((self)->events & EVENT_MASK(ev)) { \
+      (self)->on_event((self), (msg), (ev), params); \
+    } \
+  } while (0)
 
 #ifdef DEBUG
 # define DEBUGF(fmt, params...) fprintf(stderr, fmt "\n", params)
@@ -1,17 +1,287 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include "uhttp.h"
+
+int luaopen_luv(lua_State *L);
+
+static void usage(void)
+{
+  fprintf(stderr,
+    "usage: luh [-s] [-c cachedir] [-l module]... [script]\n"
+    "  -s  allocate small Lua objects from size class slabs.\n"
+    "      N.B. 64 bit LuaJIT 2.0 refuses custom allocators, there\n"
+    "      the default allocator is used\n"
+    "  -c  cache bytecode of the script and modules in cachedir,\n"
+    "      LUH_CACHE by default\n"
+    "  -l  require module before the script, so that workers forked\n"
+    "      by the script inherit it loaded\n"
+  );
+}
+
+static int panic(lua_State *L)
+{
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+      lua_tostring(L, -1));
+  return 0;
+}
+
+/*
+ * Bytecode cache.
+ * Compiled chunks are kept in the cache directory, a file per source path,
+ * headed by size, mtime and hash of the source. Stale or unloadable entry
+ * is compiled anew and rewritten
+ */
+
+static const char *cache_dir = NULL;
+
+typedef struct {
+  char magic[8];
+  uint64_t size;
+  int64_t mtime;
+  uint64_t hash;
+} cache_header_t;
+
+typedef struct {
+  char *base;
+  size_t len;
+  size_t size;
+} cache_buf_t;
+
+// FNV-1a
+static uint64_t cache_hash(const char *s, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static char *cache_read(const char *path, size_t *len)
+{
+  FILE *f = fopen(path, "rb");
+  char *data = NULL;
+  long size;
+  if (!f) return NULL;
+  if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0) {
+    rewind(f);
+    data = malloc(size + 1);
+    if (data && fread(data, 1, size, f) != (size_t)size) {
+      free(data);
+      data = NULL;
+    }
+    *len = size;
+  }
+  fclose(f);
+  return data;
+}
+
+static int cache_put(cache_buf_t *self, const void *data, size_t len)
+{
+  if (self->len + len > self->size) {
+    size_t size = self->size ? 2 * self->size : 4096;
+    while (size < self->len + len) size *= 2;
+    char *base = realloc(self->base, size);
+    if (!base) return -1;
+    self->base = base;
+    self->size = size;
+  }
+  memcpy(self->base + self->len, data, len);
+  self->len += len;
+  return 0;
+}
+
+static int cache_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+  return cache_put(ud, p, sz);
+}
+
+// N.B. written aside and renamed, as workers may race
+static void cache_store(const char *path, const cache_buf_t *buf)
+{
+  char tmp[PATH_MAX];
+  FILE *f;
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  f = fopen(tmp, "wb");
+  if (!f) return;
+  if (fwrite(buf->base, 1, buf->len, f) != buf->len) {
+    fclose(f);
+    unlink(tmp);
+    return;
+  }
+  fclose(f);
+  if (rename(tmp, path)) unlink(tmp);
+}
+
+// load file as chunk, through the cache if any. returns luaL_loadfile status
+static int cache_loadfile(lua_State *L, const char *path)
+{
+  cache_header_t want;
+  cache_buf_t dump = { NULL, 0, 0 };
+  struct stat st;
+  char cpath[PATH_MAX], chunkname[PATH_MAX + 1];
+  char *src, *cached;
+  size_t len, clen, i;
+  int status;
+
+  if (!cache_dir || stat(path, &st)) return luaL_loadfile(L, path);
+  src = cache_read(path, &len);
+  if (!src) return luaL_loadfile(L, path);
+  snprintf(chunkname, sizeof(chunkname), "@%s", path);
+  memset(&want, 0, sizeof(want));
+  memcpy(want.magic, "LUHC0001", sizeof(want.magic));
+  want.size = len;
+  want.mtime = st.st_mtime;
+  want.hash = cache_hash(src, len);
+  snprintf(cpath, sizeof(cpath), "%s/%016llx.luac", cache_dir,
+      (unsigned long long)cache_hash(path, strlen(path)));
+
+  // fresh entry?
+  cached = cache_read(cpath, &clen);
+  if (cached && clen > sizeof(want)
+      && memcmp(cached, &want, sizeof(want)) == 0)
+  {
+    status = luaL_loadbuffer(L, cached + sizeof(want), clen - sizeof(want),
+        chunkname);
+    if (status == 0) {
+      free(cached);
+      free(src);
+      return 0;
+    }
+    // e.g. written by another Lua version
+    lua_pop(L, 1);
+  }
+  free(cached);
+
+  // N.B. blank out #! line, as luaL_loadfile skips it
+  if (len && src[0] == '#') {
+    for (i = 0; i < len && src[i] != '\n'; ++i) src[i] = ' ';
+  }
+  status = luaL_loadbuffer(L, src, len, chunkname);
+  free(src);
+  if (status) return status;
+  if (cache_put(&dump, &want, sizeof(want)) == 0
+      && lua_dump(L, cache_writer, &dump) == 0)
+  {
+    cache_store(cpath, &dump);
+  }
+  free(dump.base);
+  return 0;
+}
+
+// package.loaders entry: find module on package.path, load through cache.
+// N.B. modules not found are left to standard loaders
+static int cache_loader(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  const char *path, *end, *filename;
+  FILE *f;
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "path");
+  path = lua_tostring(L, -1);
+  if (!path) return 0;
+  name = luaL_gsub(L, name, ".", "/");
+  for (; *path; path = *end ? end + 1 : end) {
+    end = strchr(path, ';');
+    if (!end) end = path + strlen(path);
+    if (end == path) continue;
+    lua_pushlstring(L, path, end - path);
+    filename = luaL_gsub(L, lua_tostring(L, -1), "?", name);
+    f = fopen(filename, "r");
+    if (f) {
+      fclose(f);
+      if (cache_loadfile(L, filename)) {
+        return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+            lua_tostring(L, 1), filename, lua_tostring(L, -1));
+      }
+      return 1;
+    }
+    lua_pop(L, 2);
+  }
+  return 0;
+}
+
+// put cache loader before the standard Lua file loader
+static void cache_install(lua_State *L)
+{
+  int i;
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "loaders");
+  for (i = lua_objlen(L, -1); i >= 2; --i) {
+    lua_rawgeti(L, -1, i);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_pushcfunction(L, cache_loader);
+  lua_rawseti(L, -2, 2);
+  lua_pop(L, 2);
+}
+
+// luh [-s] [-c cachedir] [-l module]... [script]
+// -s: allocate small Lua objects from size class slabs
+// -c: cache bytecode of the script and modules in cachedir, LUH_CACHE
+//     by default
+// -l: require module before the script, so that workers forked by the
+//     script inherit it loaded
 int main(int argc, char *argv[])
 {
-  lua_State *L = luaL_newstate();
+  lua_State *L = NULL;
+  int i = 1;
+
+  if (argc > i && strcmp(argv[i], "-s") == 0) {
+    ++i;
+    L = lua_newstate(slab_lua_alloc, NULL);
+    // N.B. 64 bit LuaJIT does not accept custom allocators
+    if (L) {
+      lua_atpanic(L, panic);
+    } else {
+      fprintf(stderr, "luh: custom allocator refused, using default\n");
+    }
+  }
+  if (!L) L = luaL_newstate();
+
+  cache_dir = getenv("LUH_CACHE");
+  if (argc > i + 1 && strcmp(argv[i], "-c") == 0) {
+    cache_dir = argv[i + 1];
+    i += 2;
+  }
+  if (cache_dir) mkdir(cache_dir, 0755);
 
   luaL_openlibs(L);
+  if (cache_dir) cache_install(L);
   luaopen_luv(L);
 
   //Image_register(L);
 
-  if (argc > 1) luaL_dofile(L, argv[1]);
+  while (argc > i + 1 && strcmp(argv[i], "-l") == 0) {
+    lua_getglobal(L, "require");
+    lua_pushstring(L, argv[i + 1]);
+    if (lua_pcall(L, 1, 0, 0)) {
+      fprintf(stderr, "luh: %s\n", lua_tostring(L, -1));
+      return 1;
+    }
+    i += 2;
+  }
+
+  if (argc > i && argv[i][0] == '-') {
+    usage();
+    return 1;
+  }
+  if (argc > i && (cache_loadfile(L, argv[i]) || lua_pcall(L, 0, 0, 0))) {
+    fprintf(stderr, "luh: %s\n", lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
   uv_run(uv_default_loop());
 
   lua_close(L);
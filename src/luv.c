@@ -1,12 +1,15 @@
 #include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
 
 #include "uhttp.h"
+#include "cluster.h"
 #include "http_parser.h"
 
 #include <lua.h>
 #include <lauxlib.h>
-
-const char *STATUS_CODES[600];
+#include <lualib.h>
+#include <luajit.h>
 
 /******************************************************************************/
 /* HTTP server
@@ -14,97 +17,803 @@ const char *STATUS_CODES[600];
 
 static lua_State *LLL;
 
+/*
+ * Per message binding state, hung off msg->data
+ */
+
+struct lco_s;
+struct lmsg_s;
+
+typedef struct ldata_s {
+  int pins; // registry ref of values referenced by queued writes
+  struct lco_s *co; // coroutine handling the request
+  struct lmsg_s *obj; // message object, invalidated on free
+  int obj_ref; // registry ref of the message object
+  struct ldata_s *next;
+} ldata_t;
+
+static ldata_t *ldata_freelist = NULL;
+
+static ldata_t *l_data(msg_t *msg)
+{
+  ldata_t *self = msg->data;
+  if (self) return self;
+  self = ldata_freelist;
+  if (self) {
+    ldata_freelist = self->next;
+  } else {
+    self = malloc(sizeof(*self));
+  }
+  self->pins = LUA_NOREF;
+  self->co = NULL;
+  self->obj = NULL;
+  self->obj_ref = LUA_NOREF;
+  msg->data = self;
+  return self;
+}
+
+/*
+ * Message objects.
+ * Userdata wrapping the message handle. Fields are computed on first
+ * access, tables are cached in the userdata environment
+ */
+
+typedef struct lmsg_s {
+  msg_t *msg; // NULL once the message is freed
+} lmsg_t;
+
+// registry refs of: known header names by id, method strings by pointer,
+// empty environment of fresh message objects
+static int HEADER_NAMES_REF, METHODS_REF, EMPTY_ENV_REF;
+
+// message handle or message object at index
+static msg_t *l_tomsg(lua_State *L, int idx)
+{
+  if (lua_islightuserdata(L, idx)) return lua_touserdata(L, idx);
+  lmsg_t *self = luaL_checkudata(L, idx, "uhttp.msg");
+  if (!self->msg) luaL_error(L, "message is freed");
+  return self->msg;
+}
+
+// msg(handle) -> message object, nil for nil handle.
+// N.B. there is one object per message, so that it is invalidated when
+// the message is freed and recycled
 static int l_msg(lua_State *L)
 {
-  const msg_t *msg = lua_touserdata(L, 1);
-  //lua_pop(L, 1);
-  //printf("MMM: %p\n", msg);
+  msg_t *msg = lua_touserdata(L, 1);
   if (!msg) {
     lua_pushnil(L);
-  } else {
-    lua_createtable(L, 0, 8);
-    luaL_getmetatable(L, "uhttp.msg");
-    lua_setmetatable(L, -2);
-    lua_pushstring(L, msg->method);
-    lua_setfield(L, -2, "method");
-    if (msg->should_keep_alive) {
-      lua_pushboolean(L, 1);
-      lua_setfield(L, -2, "should_keep_alive");
-    }
-    if (msg->upgrade) {
-      lua_pushboolean(L, 1);
-      lua_setfield(L, -2, "upgrade");
+    return 1;
+  }
+  ldata_t *ldata = l_data(msg);
+  if (ldata->obj) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ldata->obj_ref);
+    return 1;
+  }
+  lmsg_t *self = lua_newuserdata(L, sizeof(*self));
+  self->msg = msg;
+  luaL_getmetatable(L, "uhttp.msg");
+  lua_setmetatable(L, -2);
+  // N.B. shared empty environment is replaced on first cache store
+  lua_rawgeti(L, LUA_REGISTRYINDEX, EMPTY_ENV_REF);
+  lua_setfenv(L, -2);
+  lua_pushvalue(L, -1);
+  ldata->obj_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ldata->obj = self;
+  return 1;
+}
+
+// push interned method string
+static void l_push_method(lua_State *L, const char *method)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, METHODS_REF);
+  lua_pushlightuserdata(L, (void *)method);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushstring(L, method);
+    lua_pushlightuserdata(L, (void *)method);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  lua_remove(L, -2);
+}
+
+static void l_push_uri(lua_State *L, const msg_t *msg)
+{
+  static const char *field_names[] = {
+    "schema", "host", "port", "path", "query", "fragment"
+  };
+  struct http_parser_url url;
+  const char *p = msg->url.base;
+  int i;
+  lua_createtable(L, 0, 2);
+  if (http_parser_parse_url(p, msg->url.len, 0, &url) == 0) {
+    for (i = UF_SCHEMA; i < UF_MAX; ++i) if (url.field_set & (1 << i)) {
+      lua_pushlstring(L, p + url.field_data[i].off, url.field_data[i].len);
+      lua_setfield(L, -2, field_names[i]);
     }
-    // url
-    const char *p = msg->heap.base;
-    lua_pushstring(L, p);
-    lua_setfield(L, -2, "url");
-    // uri
-    {
-    lua_newtable(L);
-    struct http_parser_url url;
-    const char *field_names[] = {
-      "schema", "host", "port", "path", "query", "fragment"
-    };
-    if (http_parser_parse_url(p, strlen(p), 0, &url) == 0) {
-      int i;
-      for (i = UF_SCHEMA; i < UF_MAX; ++i) if (url.field_set & (1 << i)) {
-        lua_pushlstring(L, p + url.field_data[i].off, url.field_data[i].len);
-        lua_setfield(L, -2, field_names[i]);
-      }
+  }
+}
+
+static void l_push_headers(lua_State *L, const msg_t *msg)
+{
+  size_t i;
+  int id;
+  lua_createtable(L, 0, msg->nheaders);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, HEADER_NAMES_REF);
+  for (i = 0; i < msg->nheaders; ++i) {
+    const header_t *h = &msg->headers[i];
+    // known names are interned
+    id = header_id(h->name.base, h->name.len);
+    if (id >= 0) {
+      lua_rawgeti(L, -1, id + 1);
+    } else {
+      lua_pushlstring(L, h->name.base, h->name.len);
     }
-    lua_setfield(L, -2, "uri");
+    lua_pushlstring(L, h->value.base, h->value.len);
+    lua_rawset(L, -4);
+  }
+  lua_pop(L, 1);
+}
+
+// msg.<key>
+static int l_msg_index(lua_State *L)
+{
+  const msg_t *msg = l_tomsg(L, 1);
+  const char *key = luaL_checkstring(L, 2);
+
+  if (strcmp(key, "handle") == 0) {
+    lua_pushlightuserdata(L, (void *)msg);
+  } else if (strcmp(key, "method") == 0) {
+    l_push_method(L, msg->method);
+  } else if (strcmp(key, "url") == 0) {
+    lua_pushlstring(L, msg->url.base, msg->url.len);
+  } else if (strcmp(key, "should_keep_alive") == 0) {
+    lua_pushboolean(L, msg->should_keep_alive);
+  } else if (strcmp(key, "upgrade") == 0) {
+    lua_pushboolean(L, msg->upgrade);
+  } else if (strcmp(key, "uri") == 0 || strcmp(key, "headers") == 0) {
+    // cached?
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1)) return 1;
+    lua_pop(L, 1);
+    // materialize and cache
+    if (lua_rawequal(L, -1, lua_upvalueindex(1))) {
+      lua_pop(L, 1);
+      lua_createtable(L, 0, 2);
+      lua_pushvalue(L, -1);
+      lua_setfenv(L, 1);
     }
-    // headers
-    lua_newtable(L);
-    p += strlen(p) + 1;
-    while (*p) {
-      const char *name = p;
-      p += strlen(p) + 1;
-      lua_pushstring(L, p);
-      lua_setfield(L, -2, name);
-      p += strlen(p) + 1;
+    if (key[0] == 'u') {
+      l_push_uri(L, msg);
+    } else {
+      l_push_headers(L, msg);
     }
-    lua_setfield(L, -2, "headers");
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  // methods
+  } else {
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(2));
   }
   return 1;
 }
 
-static int GLOBAL_CB_GET_RID;
+// get request header value, case insensitive
+// header(msg, name), msg:header(name)
+static int l_header(lua_State *L)
+{
+  const msg_t *msg = l_tomsg(L, 1);
+  size_t len;
+  char name[256];
+  const uv_buf_t *value;
+  const char *s = luaL_checklstring(L, 2, &len);
+  if (!msg || len >= sizeof(name)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  // N.B. header names are stored lower cased
+  size_t i;
+  for (i = 0; i < len; ++i) name[i] = tolower(s[i]);
+  value = msg_header_len(msg, name, len);
+  if (value) {
+    lua_pushlstring(L, value->base, value->len);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+/*
+ * Watchdog.
+ * With handler_budget option, handlers run with a count hook armed, which
+ * raises an error once the budget of VM instructions is spent. The request
+ * is then answered 503 and recorded.
+ * N.B. compiled LuaJIT traces do not call hooks, so handlers and functions
+ * of the script starting the server are not compiled. Loops in functions
+ * of other modules which got compiled escape the budget, unless those
+ * modules call jit.off(true)
+ */
+
+// number of recent offenders kept
+#define WATCHDOG_OFFENDERS 16
+
+static int WATCHDOG_BUDGET = 0;
+static int watchdog_fired;
+static uint64_t watchdog_aborts = 0;
+// ring of "<method> <url>" of recent offenders
+static char watchdog_offenders[WATCHDOG_OFFENDERS][128];
+
+// N.B. the hook stays armed to fire at once again, so that pcall in the
+// handler can not swallow the error and run on without budget
+static void watchdog_hook(lua_State *L, lua_Debug *ar)
+{
+  watchdog_fired = 1;
+  lua_sethook(L, watchdog_hook, LUA_MASKCOUNT, 1);
+  luaL_error(L, "handler budget exceeded");
+}
+
+static void watchdog_arm(lua_State *L)
+{
+  watchdog_fired = 0;
+  if (WATCHDOG_BUDGET) {
+    lua_sethook(L, watchdog_hook, LUA_MASKCOUNT, WATCHDOG_BUDGET);
+  }
+}
+
+static void watchdog_disarm(lua_State *L)
+{
+  if (WATCHDOG_BUDGET) lua_sethook(L, NULL, 0, 0);
+}
+
+// record the offender and answer it
+static void watchdog_abort(msg_t *msg)
+{
+  char *s = watchdog_offenders[watchdog_aborts++ % WATCHDOG_OFFENDERS];
+  if (!msg) {
+    snprintf(s, sizeof(watchdog_offenders[0]), "-");
+    return;
+  }
+  snprintf(s, sizeof(watchdog_offenders[0]), "%s %.*s",
+      msg->method ? msg->method : "-", (int)msg->url.len, msg->url.base);
+  response_abort(msg, 503);
+}
+
+// call handler with argc args under the watchdog
+static void watchdog_call(lua_State *L, msg_t *msg, int argc)
+{
+  // N.B. nested handler call runs on the budget of outer one
+  if (!WATCHDOG_BUDGET || lua_gethook(L)) {
+    lua_call(L, argc, 0);
+    return;
+  }
+  watchdog_fired = 0;
+  watchdog_arm(L);
+  int status = lua_pcall(L, argc, 0, 0);
+  watchdog_disarm(L);
+  int fired = watchdog_fired;
+  watchdog_fired = 0;
+  if (!status) return;
+  // N.B. other errors propagate as they did with plain call
+  if (!fired) lua_error(L);
+  lua_pop(L, 1);
+  watchdog_abort(msg);
+}
+
+// watchdog_stats() -> { aborts, offenders = { "<method> <url>", ... } },
+// most recent offender first
+static int l_watchdog_stats(lua_State *L)
+{
+  uint64_t i, n = watchdog_aborts < WATCHDOG_OFFENDERS
+      ? watchdog_aborts : WATCHDOG_OFFENDERS;
+  lua_createtable(L, 0, 2);
+  lua_pushnumber(L, watchdog_aborts);
+  lua_setfield(L, -2, "aborts");
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; ++i) {
+    lua_pushstring(L,
+        watchdog_offenders[(watchdog_aborts - 1 - i) % WATCHDOG_OFFENDERS]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "offenders");
+  return 1;
+}
+
+/*
+ * Coroutine handlers.
+ * With 'coroutines' option, request handler runs in own Lua thread taken
+ * from a pool of recycled threads. sleep(), read_body() and read_file()
+ * yield the thread, uv callbacks resume it
+ */
+
+// max number of idle threads kept for reuse
+#define CO_POOL_SIZE 256
+
+// size of read_file() reads
+#define CO_READ_SIZE (64 * 1024)
+
+// what suspended thread waits for
+enum co_wait {
+  CO_RUNNING = 0,
+  CO_BODY,
+  CO_SLEEP,
+  CO_FILE,
+  CO_WORK
+};
+
+typedef struct lco_s {
+  lua_State *L;
+  msg_t *msg; // request being handled, NULL once freed
+  int wait;
+  int ended; // request body is complete
+  int body; // registry ref of request body completed before read_body()
+  wheel_timer_t timer; // sleep()
+  // read_file()
+  uv_fs_t fs;
+  int file;
+  int file_ok;
+  char *buf;
+  size_t len;
+  size_t size;
+  struct lco_s *next;
+} lco_t;
+
+static int COROUTINES = 0;
+static lco_t *co_pool = NULL;
+static int co_pool_size = 0;
+
+static lco_t *co_acquire(lua_State *L)
+{
+  lco_t *co = co_pool;
+  if (co) {
+    co_pool = co->next;
+    --co_pool_size;
+  } else {
+    co = calloc(1, sizeof(*co));
+    co->timer.data = co;
+    co->fs.data = co;
+    // N.B. registry maps thread to its state, which also keeps it alive
+    co->L = lua_newthread(L);
+    lua_pushlightuserdata(L, co);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+  }
+  co->msg = NULL;
+  co->wait = CO_RUNNING;
+  co->ended = 0;
+  co->body = LUA_NOREF;
+  return co;
+}
+
+// thread is done. N.B. thread died of error or abandoned is not reused
+static void co_release(lco_t *co, int reuse)
+{
+  lua_State *L = LLL;
+  if (co->msg) {
+    ((ldata_t *)co->msg->data)->co = NULL;
+    co->msg = NULL;
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, co->body);
+  if (reuse && co_pool_size < CO_POOL_SIZE) {
+    lua_settop(co->L, 0);
+    co->next = co_pool;
+    co_pool = co;
+    ++co_pool_size;
+    return;
+  }
+  lua_pushthread(co->L);
+  lua_xmove(co->L, L, 1);
+  lua_pushnil(L);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  free(co);
+}
+
+// run thread with nargs values on its stack, until it yields or returns
+static void co_resume(lco_t *co, int nargs)
+{
+  co->wait = CO_RUNNING;
+  watchdog_arm(co->L);
+  int status = lua_resume(co->L, nargs);
+  watchdog_disarm(co->L);
+  int fired = watchdog_fired;
+  watchdog_fired = 0;
+  if (status == LUA_YIELD) return;
+  if (status && fired) {
+    watchdog_abort(co->msg);
+  } else if (status) {
+    fprintf(stderr, "request handler: %s\n", lua_tostring(co->L, -1));
+    if (co->msg) response_abort(co->msg, 500);
+  }
+  co_release(co, status == 0);
+}
+
+// state of the thread running L, NULL if L is not a request thread
+static lco_t *l_toco(lua_State *L)
+{
+  lua_pushthread(L);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  lco_t *co = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return co;
+}
+
+static lco_t *l_checkco(lua_State *L)
+{
+  lco_t *co = l_toco(L);
+  if (!co) luaL_error(L, "not in request coroutine");
+  return co;
+}
+
+// run request handler with argc args on top of L in a new thread
+static void co_start(lua_State *L, msg_t *msg, int argc)
+{
+  lco_t *co = co_acquire(L);
+  co->msg = msg;
+  l_data(msg)->co = co;
+  lua_xmove(L, co->L, argc + 1);
+  co_resume(co, argc);
+}
+
+// request body is complete, pass it to the thread waiting for it
+static void co_on_end(msg_t *msg, size_t len, void *data)
+{
+  ldata_t *ldata = msg->data;
+  if (!ldata || !ldata->co) return;
+  lco_t *co = ldata->co;
+  // N.B. body not buffered is nil, unless there was none
+  if (data) {
+    lua_pushlstring(co->L, data, len);
+  } else if (!msg->body_len) {
+    lua_pushliteral(co->L, "");
+  } else {
+    lua_pushnil(co->L);
+  }
+  if (co->wait == CO_BODY) {
+    co_resume(co, 1);
+  } else {
+    co->body = luaL_ref(co->L, LUA_REGISTRYINDEX);
+    co->ended = 1;
+  }
+}
+
+// message is freed under the thread
+static void co_detach(lco_t *co)
+{
+  // body will never come, abandon the thread
+  if (co->wait == CO_BODY) {
+    co_release(co, 0);
+    return;
+  }
+  // N.B. sleeping or reading thread runs to completion
+  co->msg = NULL;
+}
+
+// read_body(msg) -> body, or nil and error if it was not buffered.
+// switches the request to BODY_BUFFER mode, unless some body has arrived
+// already, as chunks gone with 'data' events are lost. N.B. body which has
+// completed before the call is available only if server body_mode is
+// BODY_BUFFER
+static int l_read_body(lua_State *L)
+{
+  lco_t *co = l_checkco(L);
+  msg_t *msg = l_tomsg(L, 1);
+  luaL_argcheck(L, msg == co->msg, 1, "not the request of this coroutine");
+  if (co->ended) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, co->body);
+    luaL_unref(L, LUA_REGISTRYINDEX, co->body);
+    co->body = LUA_NOREF;
+    if (!lua_isnil(L, -1)) return 1;
+  } else if (msg->body_mode == BODY_BUFFER || !msg->body_len) {
+    msg->body_mode = BODY_BUFFER;
+    co->wait = CO_BODY;
+    return lua_yield(L, 0);
+  } else {
+    lua_pushnil(L);
+  }
+  lua_pushliteral(L, "body was not buffered");
+  return 2;
+}
+
+static void co_on_timer(wheel_timer_t *timer)
+{
+  co_resume(timer->data, 0);
+}
+
+// sleep(ms)
+static int l_sleep(lua_State *L)
+{
+  lco_t *co = l_checkco(L);
+  int timeout = luaL_checkint(L, 1);
+  co->wait = CO_SLEEP;
+  wheel_start(uv_default_loop(), &co->timer, co_on_timer,
+      timeout > 0 ? timeout : 0);
+  return lua_yield(L, 0);
+}
+
+static void co_on_file_close(uv_fs_t *req)
+{
+  lco_t *co = req->data;
+  uv_fs_req_cleanup(req);
+  if (co->file_ok) {
+    lua_pushlstring(co->L, co->buf, co->len);
+  } else {
+    lua_pushnil(co->L);
+  }
+  free(co->buf);
+  co->buf = NULL;
+  co_resume(co, 1);
+}
+
+static void co_file_close(lco_t *co, int ok)
+{
+  co->file_ok = ok;
+  uv_fs_close(uv_default_loop(), &co->fs, co->file, co_on_file_close);
+}
+
+static void co_on_file_read(uv_fs_t *req);
+
+static void co_file_read(lco_t *co)
+{
+  if (co->size - co->len < CO_READ_SIZE) {
+    size_t size = co->size ? 2 * co->size : CO_READ_SIZE;
+    char *buf = realloc(co->buf, size);
+    if (!buf) {
+      co_file_close(co, 0);
+      return;
+    }
+    co->buf = buf;
+    co->size = size;
+  }
+  uv_fs_read(uv_default_loop(), &co->fs, co->file, co->buf + co->len,
+      co->size - co->len, co->len, co_on_file_read);
+}
+
+static void co_on_file_read(uv_fs_t *req)
+{
+  lco_t *co = req->data;
+  ssize_t nread = req->result;
+  uv_fs_req_cleanup(req);
+  if (nread <= 0) {
+    co_file_close(co, nread == 0);
+    return;
+  }
+  co->len += nread;
+  co_file_read(co);
+}
+
+static void co_on_file_open(uv_fs_t *req)
+{
+  lco_t *co = req->data;
+  ssize_t fd = req->result;
+  uv_fs_req_cleanup(req);
+  if (fd < 0) {
+    lua_pushnil(co->L);
+    co_resume(co, 1);
+    return;
+  }
+  co->file = fd;
+  co->len = co->size = 0;
+  co_file_read(co);
+}
+
+// read_file(path) -> contents, nil on error
+static int l_read_file(lua_State *L)
+{
+  lco_t *co = l_checkco(L);
+  const char *path = luaL_checkstring(L, 1);
+  co->wait = CO_FILE;
+  uv_fs_open(uv_default_loop(), &co->fs, path, O_RDONLY, 0, co_on_file_open);
+  return lua_yield(L, 0);
+}
+
+// event handler refs by event. single handler function gets event code
+static int HANDLER_REFS[EVT_MAX];
+
+static void lgc_check(lua_State *L);
+static int HANDLER_TAKES_EVENT;
+
+static const char *HANDLER_NAMES[EVT_MAX] = {
+  [EVT_ERROR] = "on_error",
+  [EVT_OPEN] = "on_open",
+  [EVT_REQUEST] = "on_request",
+  [EVT_DATA] = "on_data",
+  [EVT_END] = "on_end",
+  [EVT_SHUT] = "on_shut",
+  [EVT_CLOSE] = "on_close",
+};
 
 static void on_event(client_t *self, msg_t *msg, enum event_t ev, int status, void *data)
 {
   lua_State *L = LLL;
-  int argc = 2;
-  lua_rawgeti(L, LUA_REGISTRYINDEX, GLOBAL_CB_GET_RID); // get event handler
+  int argc = 1;
+  lgc_check(L);
+  if (COROUTINES) {
+    if (ev == EVT_END) co_on_end(msg, status, data);
+    if (HANDLER_REFS[ev] == LUA_NOREF) return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, HANDLER_REFS[ev]); // get event handler
   lua_pushlightuserdata(L, msg);
-  lua_pushinteger(L, ev);
+  if (HANDLER_TAKES_EVENT) {
+    lua_pushinteger(L, ev);
+    argc += 1;
+  }
   switch (ev) {
     case EVT_DATA:
       lua_pushlstring(L, data, status);
       argc += 1;
       break;
+    // buffered body
+    case EVT_END:
+      if (data) {
+        lua_pushlstring(L, data, status);
+        argc += 1;
+      }
+      break;
     case EVT_ERROR:
       lua_pushinteger(L, status);
       argc += 1;
   }
-  lua_call(L, argc, 0);
+  if (COROUTINES && ev == EVT_REQUEST) {
+    co_start(L, msg, argc);
+    return;
+  }
+  watchdog_call(L, msg, argc);
+}
+
+// message is freed, release pinned values
+static void on_msg_free(msg_t *msg)
+{
+  ldata_t *self = msg->data;
+  if (!self) return;
+  luaL_unref(LLL, LUA_REGISTRYINDEX, self->pins);
+  if (self->co) co_detach(self->co);
+  // object may outlive the message, which is recycled
+  if (self->obj) {
+    self->obj->msg = NULL;
+    luaL_unref(LLL, LUA_REGISTRYINDEX, self->obj_ref);
+  }
+  msg->data = NULL;
+  self->next = ldata_freelist;
+  ldata_freelist = self;
+}
+
+// fill server config from options table, if any
+static void l_server_config(lua_State *L, int idx, server_config_t *config)
+{
+  server_config_init(config);
+  if (!lua_istable(L, idx)) return;
+#define CONFIG_FIELD(name) \
+  lua_getfield(L, idx, #name); \
+  if (lua_isnumber(L, -1)) config->name = lua_tonumber(L, -1); \
+  lua_pop(L, 1);
+  CONFIG_FIELD(header_timeout);
+  CONFIG_FIELD(body_timeout);
+  CONFIG_FIELD(keepalive_timeout);
+  CONFIG_FIELD(handler_timeout);
+  CONFIG_FIELD(max_header_size);
+  CONFIG_FIELD(max_body_size);
+  CONFIG_FIELD(max_pipeline);
+  CONFIG_FIELD(body_mode);
+  CONFIG_FIELD(max_buffered_body);
+#undef CONFIG_FIELD
+}
+
+// store event handlers, return mask of events to fire
+static unsigned l_handlers(lua_State *L, int idx)
+{
+  unsigned mask = 0;
+  int ev;
+  // handler(msg, ev, ...) for all events
+  if (lua_isfunction(L, idx)) {
+    lua_pushvalue(L, idx);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    for (ev = 0; ev < EVT_MAX; ++ev) HANDLER_REFS[ev] = ref;
+    HANDLER_TAKES_EVENT = 1;
+    return EVENT_ALL;
+  }
+  // { on_request = function (msg) ... end, ... }.
+  // N.B. events without handler are not fired at all
+  luaL_checktype(L, idx, LUA_TTABLE);
+  HANDLER_TAKES_EVENT = 0;
+  for (ev = 0; ev < EVT_MAX; ++ev) {
+    HANDLER_REFS[ev] = LUA_NOREF;
+    if (!HANDLER_NAMES[ev]) continue;
+    lua_getfield(L, idx, HANDLER_NAMES[ev]);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      continue;
+    }
+    luaL_checktype(L, -1, LUA_TFUNCTION);
+    HANDLER_REFS[ev] = luaL_ref(L, LUA_REGISTRYINDEX);
+    mask |= EVENT_MASK(ev);
+  }
+  return mask;
+}
+
+// do not compile handlers, and functions of the script calling make_server,
+// so that they run under the hook
+static void watchdog_nojit(lua_State *L)
+{
+  int ev;
+  luaJIT_setmode(L, 0, LUAJIT_MODE_ALLFUNC | LUAJIT_MODE_OFF);
+  for (ev = 0; ev < EVT_MAX; ++ev) {
+    if (HANDLER_REFS[ev] == LUA_NOREF) continue;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, HANDLER_REFS[ev]);
+    luaJIT_setmode(L, -1, LUAJIT_MODE_ALLFUNC | LUAJIT_MODE_OFF);
+    lua_pop(L, 1);
+  }
 }
 
 // start HTTP server
+// make_server(port, host, backlog, handler[, options])
+// handler is either function(msg, ev, ...) called for all events, or table
+// of on_open, on_request, on_data, on_end, on_shut, on_close, on_error
+// functions called as function(msg, ...). events without handler are not
+// fired.
+// options is either number of workers or table of:
+//   workers, header_timeout, body_timeout, keepalive_timeout, handler_timeout
+//   (ms, 0 means none), max_header_size, max_body_size, max_pipeline
+//   (0 means unlimited), body_mode, max_buffered_body, coroutines,
+//   handler_budget (VM instructions per handler call, 0 means unlimited;
+//   handlers and the calling script are then not compiled, other modules
+//   should call jit.off(true) to be held to the budget).
+// with coroutines set, request handler runs in own coroutine and may call
+// sleep(), read_body() and read_file(), which yield.
+// if workers > 0, the master binds the socket and forks workers which share
+// it. make_server returns 1-based worker index in a worker, and never returns
+// in the master. without workers, 0 is returned
 static int l_make_server(lua_State *L)
 {
+  server_config_t config;
+  server_t *server;
   int port = luaL_checkint(L, 1);
   const char *host = luaL_checkstring(L, 2);
   int backlog_size = luaL_checkint(L, 3);
-  uv_tcp_t *server = server_init(port, host, backlog_size, on_event);
-  GLOBAL_CB_GET_RID = luaL_ref(L, LUA_REGISTRYINDEX); // store event handler
-  return 0;
+  unsigned events = l_handlers(L, 4);
+  int nworkers = 0;
+  int worker = 0;
+  if (lua_istable(L, 5)) {
+    lua_getfield(L, 5, "workers");
+    nworkers = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, 5, "coroutines");
+    COROUTINES = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, 5, "handler_budget");
+    WATCHDOG_BUDGET = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+  } else {
+    nworkers = luaL_optint(L, 5, 0);
+  }
+  l_server_config(L, 5, &config);
+  lua_settop(L, 4);
+  if (WATCHDOG_BUDGET) watchdog_nojit(L);
+  if (COROUTINES) {
+    luaL_argcheck(L, events & EVENT_MASK(EVT_REQUEST), 4,
+        "coroutines need request handler");
+    // to resume threads waiting for body
+    events |= EVENT_MASK(EVT_END);
+  }
+  if (nworkers > 0) {
+    int fd = cluster_bind(host, port, backlog_size);
+    worker = cluster_fork(nworkers);
+    server = server_open(uv_default_loop(), fd, backlog_size, on_event,
+        &config);
+  } else {
+    server = server_init(port, host, backlog_size, on_event, &config);
+  }
+  server->on_msg_free = on_msg_free;
+  server->events = events;
+  lua_pushinteger(L, worker);
+  return 1;
 }
 
 // finish the response
 static int l_end(lua_State *L) {
-  msg_t *self = lua_touserdata(L, 1);
+  msg_t *self = l_tomsg(L, 1);
   if (self->chunked) {
     response_write(self, "0\r\n\r\n", 5);
   }
@@ -112,53 +821,316 @@ static int l_end(lua_State *L) {
   return 0;
 }
 
+// get or set, in 'request' handler, how request body is delivered
+static int l_body_mode(lua_State *L) {
+  msg_t *self = l_tomsg(L, 1);
+  if (!lua_isnoneornil(L, 2)) {
+    int mode = luaL_checkint(L, 2);
+    luaL_argcheck(L, mode >= BODY_STREAM && mode <= BODY_DISCARD, 2,
+        "invalid body mode");
+    self->body_mode = mode;
+  }
+  lua_pushinteger(L, self->body_mode);
+  return 1;
+}
+
+/*
+ * Compiled response headers.
+ * Serialized once by headers{...}, written by send() as is
+ */
+
+typedef struct {
+  int has_content_length : 1;
+  int has_transfer_encoding : 1;
+  int chunked : 1;
+  int has_date : 1;
+  size_t len;
+  char data[0];
+} headers_t;
+
+// compiled headers at index, or NULL
+static headers_t *l_toheaders(lua_State *L, int idx)
+{
+  headers_t *self = lua_touserdata(L, idx);
+  if (!self || !lua_getmetatable(L, idx)) return NULL;
+  luaL_getmetatable(L, "uhttp.headers");
+  if (!lua_rawequal(L, -1, -2)) self = NULL;
+  lua_pop(L, 2);
+  return self;
+}
+
+// compile headers table
+// headers{ ["Content-Type"] = "text/plain", ... }
+// N.B. compiled headers are never collected, so that they can be written
+// without copying. create them once, not per request
+static int l_headers(lua_State *L)
+{
+  size_t len = 0, klen, vlen;
+  const char *k, *v;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  // measure
+  lua_pushnil(L);
+  while (lua_next(L, 1) != 0) {
+    luaL_checktype(L, -2, LUA_TSTRING);
+    lua_tolstring(L, -2, &klen);
+    luaL_checklstring(L, -1, &vlen);
+    len += klen + 2 + vlen + 2;
+    lua_pop(L, 1);
+  }
+  headers_t *self = lua_newuserdata(L, sizeof(*self) + len);
+  memset(self, 0, sizeof(*self));
+  // serialize
+  char *p = self->data;
+  lua_pushnil(L);
+  while (lua_next(L, 1) != 0) {
+    k = lua_tolstring(L, -2, &klen);
+    v = lua_tolstring(L, -1, &vlen);
+    if (strcasecmp(k, "content-length") == 0) {
+      self->has_content_length = 1;
+    } else if (strcasecmp(k, "transfer-encoding") == 0) {
+      self->has_transfer_encoding = 1;
+      if (strcasecmp(v, "chunked") == 0) self->chunked = 1;
+    } else if (strcasecmp(k, "date") == 0) {
+      self->has_date = 1;
+    }
+    memcpy(p, k, klen); p += klen;
+    *p++ = ':'; *p++ = ' ';
+    memcpy(p, v, vlen); p += vlen;
+    *p++ = '\r'; *p++ = '\n';
+    lua_pop(L, 1);
+  }
+  self->len = p - self->data;
+  luaL_getmetatable(L, "uhttp.headers");
+  lua_setmetatable(L, -2);
+  // pin
+  lua_pushvalue(L, -1);
+  luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+// write response head using compiled headers
+static void l_send_headers(
+    msg_t *self,
+    int code,
+    const headers_t *headers,
+    size_t body_len,
+    int finish
+  )
+{
+  if (code) {
+    response_write_status(self, code);
+  }
+  self->headers_sent = 1;
+  self->has_content_length = headers->has_content_length;
+  self->has_transfer_encoding = headers->has_transfer_encoding;
+  self->chunked = headers->chunked;
+  response_write(self, headers->data, headers->len);
+  if (code && !headers->has_date) {
+    const uv_buf_t *date = response_date(self->client->server->handle.loop);
+    response_write(self, date->base, date->len);
+  }
+  // determine whether response should be chunk encoded.
+  // explicit Content-Length: voids chunk encoding
+  if (self->has_content_length) {
+    self->chunked = 0;
+  // neither Content-Length: nor Transfer-Encoding: chunked was met.
+  } else if (!self->has_transfer_encoding) {
+    // response is to be finished? we know body length
+    if (finish) {
+      char s[sizeof("Content-Length: \r\n") + FORMAT_UINT_SIZE];
+      char *end = s + sizeof(s);
+      *--end = '\n';
+      *--end = '\r';
+      char *p = format_uint(end, body_len);
+      p -= sizeof("Content-Length: ") - 1;
+      memcpy(p, "Content-Length: ", sizeof("Content-Length: ") - 1);
+      response_write(self, p, s + sizeof(s) - p);
+    // response is not finished. setup chunking
+    } else if (!self->no_chunking) {
+      response_write(self, "Transfer-Encoding: chunked\r\n", 28);
+      self->chunked = 1;
+    }
+  }
+  response_write(self, "\r\n", 2);
+}
+
+/*
+ * Rope buffer.
+ * Accumulates response body in pooled chunks, send() takes the chunks
+ */
+
+// buffer at index, or NULL
+static rope_t *l_tobuffer(lua_State *L, int idx)
+{
+  rope_t *self = lua_touserdata(L, idx);
+  if (!self || !lua_getmetatable(L, idx)) return NULL;
+  luaL_getmetatable(L, "uhttp.buffer");
+  if (!lua_rawequal(L, -1, -2)) self = NULL;
+  lua_pop(L, 2);
+  return self;
+}
+
+// buffer()
+static int l_buffer(lua_State *L)
+{
+  rope_t *self = lua_newuserdata(L, sizeof(*self));
+  rope_init(self);
+  luaL_getmetatable(L, "uhttp.buffer");
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+// buf:append(str, ...)
+static int l_buffer_append(lua_State *L)
+{
+  rope_t *self = luaL_checkudata(L, 1, "uhttp.buffer");
+  int i, n = lua_gettop(L);
+  size_t len;
+  const char *s;
+  for (i = 2; i <= n; ++i) {
+    s = luaL_checklstring(L, i, &len);
+    if (rope_append(self, s, len)) return luaL_error(L, "out of memory");
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+// buf:append_int(n)
+static int l_buffer_append_int(lua_State *L)
+{
+  rope_t *self = luaL_checkudata(L, 1, "uhttp.buffer");
+  lua_Integer n = luaL_checkinteger(L, 2);
+  char s[FORMAT_UINT_SIZE + 1];
+  char *end = s + sizeof(s);
+  char *p = format_uint(end, n < 0 ? -(uint64_t)n : (uint64_t)n);
+  if (n < 0) *--p = '-';
+  if (rope_append(self, p, end - p)) return luaL_error(L, "out of memory");
+  lua_settop(L, 1);
+  return 1;
+}
+
+// buf:append_escaped(str), HTML escaped
+static int l_buffer_append_escaped(lua_State *L)
+{
+  rope_t *self = luaL_checkudata(L, 1, "uhttp.buffer");
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  if (rope_append_escaped(self, s, len)) {
+    return luaL_error(L, "out of memory");
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int l_buffer_len(lua_State *L)
+{
+  rope_t *self = luaL_checkudata(L, 1, "uhttp.buffer");
+  lua_pushinteger(L, self->len);
+  return 1;
+}
+
+// flatten, mostly for debugging
+static int l_buffer_tostring(lua_State *L)
+{
+  rope_t *self = luaL_checkudata(L, 1, "uhttp.buffer");
+  rope_chunk_t *chunk;
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  for (chunk = self->head; chunk; chunk = chunk->next) {
+    luaL_addlstring(&b, chunk->data, chunk->len);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int l_buffer_gc(lua_State *L)
+{
+  rope_t *self = luaL_checkudata(L, 1, "uhttp.buffer");
+  rope_free(self);
+  return 0;
+}
+
+static const luaL_Reg buffer_methods[] = {
+  { "append", l_buffer_append },
+  { "append_int", l_buffer_append_int },
+  { "append_escaped", l_buffer_append_escaped },
+  { NULL, NULL }
+};
+
+// keep value at index alive until the message is freed
+static void l_pin(lua_State *L, msg_t *self, int idx)
+{
+  if (idx < 0) idx = lua_gettop(L) + idx + 1;
+  // N.B. pinned values live in per message table
+  ldata_t *ldata = l_data(self);
+  if (ldata->pins == LUA_NOREF) {
+    lua_createtable(L, 4, 0);
+    ldata->pins = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ldata->pins);
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+  lua_pop(L, 1);
+}
+
+// write string at index without copying
+static void l_write(lua_State *L, msg_t *self, int idx)
+{
+  size_t len;
+  const char *s = lua_tolstring(L, idx, &len);
+  if (s && len && response_write(self, s, len) > 0) {
+    l_pin(L, self, idx);
+  }
+}
+
 // write the response
+// N.B. body strings are not copied, but referenced until written.
+// buffer body is consumed
 static int l_send(lua_State *L)
 {
-  size_t len;
+  size_t len, body_len = 0;
   const char *s;
   luaL_Buffer b;
 
   //self, body, code, headers, do-not-end
-  msg_t *self = lua_touserdata(L, 1);
+  msg_t *self = l_tomsg(L, 1);
   int code = lua_tointeger(L, 3);
   int finish = lua_toboolean(L, 5) == 0;
+  size_t i, n = 0;
+  rope_t *rope = l_tobuffer(L, 2);
 
-  // collect body
+  // measure body
   // TODO: if method is HEAD, body is ""
+  // buffer case?
+  if (rope) {
+    body_len = rope->len;
   // table case?
-  if (lua_istable(L, 2)) {
-    size_t i;
-    len = lua_objlen(L, 2);
-    luaL_buffinit(L, &b);
-    for (i = 1; i <= len; ++i) {
+  } else if (lua_istable(L, 2)) {
+    n = lua_objlen(L, 2);
+    for (i = 1; i <= n; ++i) {
       lua_rawgeti(L, 2, i);
-      luaL_addvalue(&b);
+      luaL_checklstring(L, -1, &len);
+      body_len += len;
+      lua_pop(L, 1);
     }
-    luaL_pushresult(&b); // body
   // something else case?
   } else if (!lua_isnoneornil(L, 2)) {
-    lua_pushvalue(L, 2); // body
-  // none or nil
-  } else {
-    lua_pushliteral(L, ""); // body
+    luaL_checklstring(L, 2, &body_len);
   }
 
+  // compiled headers? write them as is
+  headers_t *headers = l_toheaders(L, 4);
+  if (headers && !self->headers_sent) {
+    l_send_headers(self, code, headers, body_len, finish);
+    lua_pushliteral(L, ""); // headers
   // collect code and headers
-  if (!self->headers_sent && (code || lua_istable(L, 4))) {
+  } else if (!self->headers_sent && (code || lua_istable(L, 4))) {
+    int has_date = 0;
     luaL_buffinit(L, &b);
     if (code) {
-      self->headers_sent = 1;
       // start response
       // TODO: real version
-      luaL_addstring(&b, "HTTP/1.1 ");
-      // append code
-      lua_pushvalue(L, 3);
-      luaL_addvalue(&b);
-      luaL_addchar(&b, ' ');
-      // append status message
-      luaL_addstring(&b, STATUS_CODES[code]);
-      luaL_addstring(&b, "\r\n");
+      response_write_status(self, code);
     }
     // append headers
     if (lua_istable(L, 4)) {
@@ -174,6 +1146,8 @@ static int l_send(lua_State *L)
         } else if (!self->has_transfer_encoding
               && strcasecmp(s, "transfer-encoding") == 0) {
           self->has_transfer_encoding = 1;
+        } else if (!has_date && strcasecmp(s, "date") == 0) {
+          has_date = 1;
         }
         lua_pushvalue(L, -2);
         luaL_addvalue(&b);
@@ -198,10 +1172,12 @@ static int l_send(lua_State *L)
         // no chunking and we need to know body length
         if (finish) {
           // get body length
-          len = lua_objlen(L, -1);
-          s = luaL_prepbuffer(&b);
-          sprintf((char *)s, "Content-Length: %" PRIu32 "\r\n", (uint32_t)len);
-          luaL_addsize(&b, strlen(s));
+          char n[FORMAT_UINT_SIZE];
+          char *end = n + sizeof(n);
+          s = format_uint(end, body_len);
+          luaL_addstring(&b, "Content-Length: ");
+          luaL_addlstring(&b, s, end - s);
+          luaL_addstring(&b, "\r\n");
           ////self->chunked = 0;
         // response is not finished. setup chunking
         } else if (!self->no_chunking) {
@@ -209,44 +1185,76 @@ static int l_send(lua_State *L)
           self->chunked = 1;
         }
       }
+    }
+    // append cached Date:, unless given
+    if (code && !has_date) {
+      const uv_buf_t *date = response_date(self->client->server->handle.loop);
+      luaL_addlstring(&b, date->base, date->len);
+    }
+    if (lua_istable(L, 4)) {
       luaL_addstring(&b, "\r\n");
     }
-    luaL_pushresult(&b); // body, headers
+    luaL_pushresult(&b); // headers
   } else {
-    lua_pushliteral(L, ""); // body, headers
+    lua_pushliteral(L, ""); // headers
   }
-
-  // swap the stack
-  lua_insert(L, -2); // headers, body
+  l_write(L, self, -1);
 
   // chunked encoding wraps the body
+  if (self->chunked && body_len > 0) {
+    char hex[20];
+    response_write(self, hex,
+        sprintf(hex, "%" PRIx32 "\r\n", (uint32_t)body_len));
+  }
+
+  // write body pieces as is
+  if (rope) {
+    response_write_rope(self, rope);
+  } else if (lua_istable(L, 2)) {
+    for (i = 1; i <= n; ++i) {
+      lua_rawgeti(L, 2, i);
+      l_write(L, self, -1);
+      lua_pop(L, 1);
+    }
+  } else if (body_len) {
+    l_write(L, self, 2);
+  }
+
   if (self->chunked) {
-    len = lua_objlen(L, -1);
-    luaL_buffinit(L, &b);
-    if (len > 0) {
-      s = luaL_prepbuffer(&b);
-      sprintf((char *)s, "%" PRIx32 "\r\n", (uint32_t)len);
-      luaL_addsize(&b, strlen(s));
-      luaL_addvalue(&b);
-      luaL_addstring(&b, "\r\n");
+    if (body_len > 0) {
+      response_write(self, "\r\n", 2);
     }
     // finishing chunk
     if (finish) {
-      luaL_addstring(&b, "0\r\n\r\n");
+      response_write(self, "0\r\n\r\n", 5);
     }
-    luaL_pushresult(&b); // headers, chunked body
   }
 
-  // concat: headers + body
-  lua_concat(L, 2);
-  s = luaL_checklstring(L, -1, &len);
-//printf("SEND %*s\n", len, s);
-  response_write(self, s, len);
   // finish response
   if (finish) {
     response_end(self);
   }
 
+  return 0;
+}
+
+// cached "HTTP/1.1 <code> <reason>\r\n", nil for unknown code
+static int l_status_line(lua_State *L)
+{
+  const uv_buf_t *line = response_status_line(luaL_checkint(L, 1));
+  if (line) {
+    lua_pushlstring(L, line->base, line->len);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// cached "Date: <now>\r\n"
+static int l_date(lua_State *L)
+{
+  const uv_buf_t *date = response_date(uv_default_loop());
+  lua_pushlstring(L, date->base, date->len);
   return 1;
 }
 
@@ -254,46 +1262,542 @@ static int l_send(lua_State *L)
 /* timer
 /******************************************************************************/
 
+/*
+ * Timers run on the per-loop timer wheel, so resolution is WHEEL_TICK ms.
+ * Timer states are pooled. Handles refer to them by generation, so that
+ * stopping fired timer is harmless
+ */
+
+typedef struct ltimer_s {
+  wheel_timer_t timer;
+  int cb; // registry ref of callback
+  uint64_t interval; // repeat period, 0 for one shot
+  unsigned gen; // bumped on release, invalidates handles
+  struct ltimer_s *next;
+} ltimer_t;
+
 typedef struct {
-  uv_timer_t timer;
-  lua_State *L;
-  int cb;
-} delay_t;
+  ltimer_t *timer;
+  unsigned gen;
+} ltimer_handle_t;
 
-static void delay_on_close(uv_handle_t *timer)
+static ltimer_t *ltimer_freelist = NULL;
+
+static void ltimer_release(ltimer_t *self)
 {
-  delay_t *delay = timer->data;
-  free((void *)delay);
+  wheel_stop(&self->timer);
+  luaL_unref(LLL, LUA_REGISTRYINDEX, self->cb);
+  self->cb = LUA_NOREF;
+  ++self->gen;
+  self->next = ltimer_freelist;
+  ltimer_freelist = self;
 }
 
-static void delay_on_timer(uv_timer_t *timer, int status)
+static void ltimer_on_timer(wheel_timer_t *timer)
 {
-  delay_t *delay = timer->data;
-  lua_State *L = delay->L;
-  lua_rawgeti(L, LUA_REGISTRYINDEX, delay->cb);
-  luaL_unref(L, LUA_REGISTRYINDEX, delay->cb);
-  lua_call(L, 0, 0);
-#if 0
-  if (!uv_is_closing((uv_handle_t *)&delay->timer)) {
-    // TODO: delayed until https://github.com/joyent/libuv/issues/364 solved
-    uv_close((uv_handle_t *)&delay->timer, delay_on_close);
+  ltimer_t *self = timer->data;
+  lua_State *L = LLL;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, self->cb);
+  // N.B. rearm or release before the call, so that callback may stop it
+  if (self->interval) {
+    wheel_start(uv_default_loop(), &self->timer, ltimer_on_timer,
+        self->interval);
+  } else {
+    ltimer_release(self);
   }
-#else
-  delay_on_close((uv_handle_t *)timer);
-#endif
+  lua_call(L, 0, 0);
 }
 
+// delay(ms, cb[, interval]) -> timer.
+// calls cb in ms, then every interval ms, if given
 static int l_delay(lua_State *L)
 {
-  delay_t *delay = malloc(sizeof(*delay));
-  delay->timer.data = delay;
-  delay->L = L;
-  delay->cb = luaL_ref(L, LUA_REGISTRYINDEX);
-  uv_timer_init(uv_default_loop(), &delay->timer);
-  uv_timer_start(&delay->timer, delay_on_timer, luaL_checkint(L, 1), 0);
+  int timeout = luaL_checkint(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  int interval = luaL_optint(L, 3, 0);
+  ltimer_t *self = ltimer_freelist;
+  if (self) {
+    ltimer_freelist = self->next;
+  } else {
+    self = calloc(1, sizeof(*self));
+    self->timer.data = self;
+  }
+  lua_pushvalue(L, 2);
+  self->cb = luaL_ref(L, LUA_REGISTRYINDEX);
+  self->interval = interval > 0 ? interval : 0;
+  wheel_start(uv_default_loop(), &self->timer, ltimer_on_timer,
+      timeout > 0 ? timeout : 0);
+  ltimer_handle_t *handle = lua_newuserdata(L, sizeof(*handle));
+  handle->timer = self;
+  handle->gen = self->gen;
+  luaL_getmetatable(L, "uhttp.timer");
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+// timer:stop(). N.B. stopping fired or stopped timer is ok
+static int l_timer_stop(lua_State *L)
+{
+  ltimer_handle_t *handle = luaL_checkudata(L, 1, "uhttp.timer");
+  if (handle->timer->gen == handle->gen) {
+    ltimer_release(handle->timer);
+  }
   return 0;
 }
 
+/******************************************************************************/
+/* worker states
+/******************************************************************************/
+
+/*
+ * CPU bound Lua off the loop.
+ * Worker states have a module loaded. work() runs a function of the
+ * module in a free worker state on the threadpool. Arguments and results
+ * cross states serialized, as nil, booleans, numbers, strings and tables
+ * of those
+ */
+
+// default number of worker states
+#define WORK_STATES 4
+// max depth of serialized tables
+#define WORK_MAX_DEPTH 32
+
+typedef struct {
+  char *base;
+  size_t len;
+  size_t size;
+} wbuf_t;
+
+typedef struct lworker_s {
+  lua_State *L;
+  int module; // registry ref of the module, in L
+  struct lworker_s *next;
+} lworker_t;
+
+typedef struct lwork_s {
+  uv_work_t req;
+  lworker_t *worker;
+  wbuf_t buf; // function name and arguments in, results or error out
+  int nresults;
+  int ok;
+  int cb; // registry ref of callback
+  lco_t *co; // or thread waiting for results
+  struct lwork_s *next;
+} lwork_t;
+
+static int lworkers_count = 0;
+static lworker_t *lworkers = NULL; // free worker states
+static lwork_t *lwork_head = NULL; // works waiting for a state
+static lwork_t *lwork_tail = NULL;
+
+static int wbuf_put(wbuf_t *self, const void *data, size_t len)
+{
+  if (self->len + len > self->size) {
+    size_t size = self->size ? 2 * self->size : 256;
+    while (size < self->len + len) size *= 2;
+    char *base = realloc(self->base, size);
+    if (!base) return -1;
+    self->base = base;
+    self->size = size;
+  }
+  memcpy(self->base + self->len, data, len);
+  self->len += len;
+  return 0;
+}
+
+// serialize value at index, -1 if it can not be
+static int l_encode(lua_State *L, int idx, wbuf_t *buf, int depth)
+{
+  char tag;
+  if (idx < 0) idx = lua_gettop(L) + idx + 1;
+  switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+      return wbuf_put(buf, "n", 1);
+    case LUA_TBOOLEAN:
+      return wbuf_put(buf, lua_toboolean(L, idx) ? "t" : "f", 1);
+    case LUA_TNUMBER: {
+      lua_Number n = lua_tonumber(L, idx);
+      if (wbuf_put(buf, "d", 1)) return -1;
+      return wbuf_put(buf, &n, sizeof(n));
+    }
+    case LUA_TSTRING: {
+      size_t len;
+      const char *s = lua_tolstring(L, idx, &len);
+      if (wbuf_put(buf, "s", 1) || wbuf_put(buf, &len, sizeof(len))) {
+        return -1;
+      }
+      return wbuf_put(buf, s, len);
+    }
+    case LUA_TTABLE:
+      // N.B. cycles are caught by depth limit
+      if (depth >= WORK_MAX_DEPTH || wbuf_put(buf, "T", 1)) return -1;
+      lua_pushnil(L);
+      while (lua_next(L, idx)) {
+        if (l_encode(L, -2, buf, depth + 1)
+            || l_encode(L, -1, buf, depth + 1))
+        {
+          lua_pop(L, 2);
+          return -1;
+        }
+        lua_pop(L, 1);
+      }
+      tag = 'E';
+      return wbuf_put(buf, &tag, 1);
+  }
+  return -1;
+}
+
+// push value serialized at *p, -1 if data is malformed
+static int l_decode(lua_State *L, const char **p, const char *end)
+{
+  const char *s = *p;
+  size_t len;
+  lua_Number n;
+  if (s >= end) return -1;
+  switch (*s++) {
+    case 'n':
+      lua_pushnil(L);
+      break;
+    case 't':
+    case 'f':
+      lua_pushboolean(L, s[-1] == 't');
+      break;
+    case 'd':
+      if (end - s < (ptrdiff_t)sizeof(n)) return -1;
+      memcpy(&n, s, sizeof(n));
+      s += sizeof(n);
+      lua_pushnumber(L, n);
+      break;
+    case 's':
+      if (end - s < (ptrdiff_t)sizeof(len)) return -1;
+      memcpy(&len, s, sizeof(len));
+      s += sizeof(len);
+      if ((size_t)(end - s) < len) return -1;
+      lua_pushlstring(L, s, len);
+      s += len;
+      break;
+    case 'T':
+      lua_newtable(L);
+      while (s < end && *s != 'E') {
+        if (l_decode(L, &s, end) || l_decode(L, &s, end)) {
+          lua_pop(L, 1);
+          return -1;
+        }
+        // N.B. nil keys come from nowhere, but stay safe
+        if (lua_isnil(L, -2)) {
+          lua_pop(L, 2);
+        } else {
+          lua_rawset(L, -3);
+        }
+      }
+      if (s >= end) {
+        lua_pop(L, 1);
+        return -1;
+      }
+      ++s;
+      break;
+    default:
+      return -1;
+  }
+  *p = s;
+  return 0;
+}
+
+// threadpool: call the function in the worker state
+static void lwork_on_work(uv_work_t *req)
+{
+  lwork_t *self = req->data;
+  lua_State *L = self->worker->L;
+  const char *p = self->buf.base;
+  const char *end = p + self->buf.len;
+  int base, n;
+  lua_settop(L, 0);
+  // function name
+  lua_rawgeti(L, LUA_REGISTRYINDEX, self->worker->module);
+  if (l_decode(L, &p, end)) goto malformed;
+  lua_gettable(L, 1);
+  base = lua_gettop(L);
+  // arguments
+  while (p < end) {
+    if (l_decode(L, &p, end)) goto malformed;
+  }
+  self->buf.len = 0;
+  self->ok = !lua_pcall(L, lua_gettop(L) - base, LUA_MULTRET, 0);
+  self->nresults = lua_gettop(L) - base + 1;
+  if (self->ok) {
+    for (n = base; n <= lua_gettop(L); ++n) {
+      if (l_encode(L, n, &self->buf, 0)) {
+        self->buf.len = 0;
+        self->ok = 0;
+        lua_pushliteral(L, "result can not be serialized");
+        break;
+      }
+    }
+  }
+  if (!self->ok) {
+    self->buf.len = 0;
+    self->nresults = 1;
+    l_encode(L, -1, &self->buf, 0);
+  }
+  lua_settop(L, 0);
+  return;
+malformed:
+  self->ok = 0;
+  self->nresults = 1;
+  self->buf.len = 0;
+  lua_pushliteral(L, "malformed work");
+  l_encode(L, -1, &self->buf, 0);
+  lua_settop(L, 0);
+}
+
+static void lwork_on_after_work(uv_work_t *req);
+
+// run work in the worker state
+static void lwork_dispatch(lwork_t *self, lworker_t *worker)
+{
+  self->worker = worker;
+  self->req.data = self;
+  uv_queue_work(uv_default_loop(), &self->req, lwork_on_work,
+      lwork_on_after_work);
+}
+
+// loop: release the state, deliver results
+static void lwork_on_after_work(uv_work_t *req)
+{
+  lwork_t *self = req->data;
+  lworker_t *worker = self->worker;
+  lua_State *L = self->co ? self->co->L : LLL;
+  const char *p = self->buf.base;
+  const char *end = p + self->buf.len;
+  int n;
+  // next waiting work takes the state
+  if (lwork_head) {
+    lwork_t *next = lwork_head;
+    lwork_head = next->next;
+    if (!lwork_head) lwork_tail = NULL;
+    lwork_dispatch(next, worker);
+  } else {
+    worker->next = lworkers;
+    lworkers = worker;
+  }
+  // ok, results... or false, error
+  if (!self->co) lua_rawgeti(L, LUA_REGISTRYINDEX, self->cb);
+  lua_pushboolean(L, self->ok);
+  for (n = 0; n < self->nresults; ++n) {
+    if (l_decode(L, &p, end)) lua_pushnil(L);
+  }
+  free(self->buf.base);
+  if (self->co) {
+    lco_t *co = self->co;
+    free(self);
+    co_resume(co, 1 + n);
+  } else {
+    luaL_unref(L, LUA_REGISTRYINDEX, self->cb);
+    free(self);
+    lua_call(L, 1 + n, 0);
+  }
+}
+
+// work_pool(module[, n]) loads module in n worker states
+static int l_work_pool(lua_State *L)
+{
+  const char *module = luaL_checkstring(L, 1);
+  int i, n = luaL_optint(L, 2, WORK_STATES);
+  for (i = 0; i < n; ++i) {
+    lworker_t *worker = calloc(1, sizeof(*worker));
+    lua_State *W = worker->L = luaL_newstate();
+    luaL_openlibs(W);
+    lua_getglobal(W, "require");
+    lua_pushstring(W, module);
+    if (lua_pcall(W, 1, 1, 0) || !lua_istable(W, -1)) {
+      lua_pushfstring(L, "work_pool: %s: %s", module,
+          lua_isstring(W, -1) ? lua_tostring(W, -1) : "not a table");
+      lua_close(W);
+      free(worker);
+      return lua_error(L);
+    }
+    worker->module = luaL_ref(W, LUA_REGISTRYINDEX);
+    worker->next = lworkers;
+    lworkers = worker;
+    ++lworkers_count;
+  }
+  return 0;
+}
+
+// work(fn_name, args, cb) calls module.fn_name(unpack(args)) in a worker
+// state, then cb(true, results...) or cb(false, error).
+// without cb, in request coroutine, yields and returns the same
+static int l_work(lua_State *L)
+{
+  size_t i, nargs;
+  lwork_t *self;
+  lco_t *co = NULL;
+  luaL_checkstring(L, 1);
+  if (!lworkers_count) return luaL_error(L, "no work_pool");
+  if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TTABLE);
+  if (!lua_isfunction(L, 3)) co = l_checkco(L);
+  self = calloc(1, sizeof(*self));
+  self->cb = LUA_NOREF;
+  if (l_encode(L, 1, &self->buf, 0)) goto unserializable;
+  nargs = lua_istable(L, 2) ? lua_objlen(L, 2) : 0;
+  for (i = 1; i <= nargs; ++i) {
+    lua_rawgeti(L, 2, i);
+    if (l_encode(L, -1, &self->buf, 0)) goto unserializable;
+    lua_pop(L, 1);
+  }
+  if (co) {
+    self->co = co;
+    co->wait = CO_WORK;
+  } else {
+    lua_pushvalue(L, 3);
+    self->cb = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  // free state? run now, else wait for one
+  if (lworkers) {
+    lworker_t *worker = lworkers;
+    lworkers = worker->next;
+    lwork_dispatch(self, worker);
+  } else if (lwork_tail) {
+    lwork_tail->next = self;
+    lwork_tail = self;
+  } else {
+    lwork_head = lwork_tail = self;
+  }
+  return co ? lua_yield(L, 0) : 0;
+unserializable:
+  free(self->buf.base);
+  free(self);
+  return luaL_error(L, "work arguments can not be serialized");
+}
+
+/******************************************************************************/
+/* garbage collector
+/******************************************************************************/
+
+/*
+ * Collection out of request handlers.
+ * Automatic collector is stopped. Steps are made right before the loop
+ * polls for I/O, until the cycle is over. Next cycle starts when the heap
+ * doubles. Heap exceeding the ceiling forces a step before an event
+ */
+
+typedef struct {
+  uv_prepare_t prepare; // steps before I/O is polled
+  uv_idle_t idle; // keeps poll from blocking while the cycle is running
+  int step; // step size, as of LUA_GCSTEP
+  int ceiling; // heap size to force steps at, KB, 0 means none
+  int threshold; // heap size to start next cycle at, KB
+  int running; // cycle is in progress
+  // stats
+  uint64_t steps;
+  uint64_t cycles;
+  uint64_t forced;
+  uint64_t time; // spent in steps, ns
+} lgc_t;
+
+static lgc_t *lgc = NULL;
+
+// make a step, return whether the cycle is over
+static int lgc_step(lua_State *L)
+{
+  uint64_t start = uv_hrtime();
+  int done = lua_gc(L, LUA_GCSTEP, lgc->step);
+  // N.B. stepping rearms automatic collector
+  lua_gc(L, LUA_GCSTOP, 0);
+  lgc->time += uv_hrtime() - start;
+  ++lgc->steps;
+  lgc->running = !done;
+  if (done) {
+    ++lgc->cycles;
+    lgc->threshold = 2 * lua_gc(L, LUA_GCCOUNT, 0);
+  }
+  return done;
+}
+
+static void lgc_on_idle(uv_idle_t *handle, int status)
+{
+}
+
+static void lgc_on_prepare(uv_prepare_t *handle, int status)
+{
+  lua_State *L = LLL;
+  if (!lgc->running && lua_gc(L, LUA_GCCOUNT, 0) < lgc->threshold) return;
+  if (lgc_step(L)) {
+    uv_idle_stop(&lgc->idle);
+  } else {
+    uv_idle_start(&lgc->idle, lgc_on_idle);
+  }
+}
+
+// heap is over the ceiling? step now
+static void lgc_check(lua_State *L)
+{
+  if (lgc && lgc->ceiling && lua_gc(L, LUA_GCCOUNT, 0) >= lgc->ceiling) {
+    ++lgc->forced;
+    lgc_step(L);
+  }
+}
+
+// gc_schedule([step[, ceiling]]) switches to manual collection.
+// step is step size as of collectgarbage('step'), ceiling is heap size
+// in KB to force steps at, 0 means none
+static int l_gc_schedule(lua_State *L)
+{
+  if (!lgc) {
+    uv_loop_t *loop = uv_default_loop();
+    lgc = calloc(1, sizeof(*lgc));
+    uv_prepare_init(loop, &lgc->prepare);
+    uv_idle_init(loop, &lgc->idle);
+    // N.B. collector alone does not keep the loop alive
+    uv_unref((uv_handle_t *)&lgc->prepare);
+    uv_unref((uv_handle_t *)&lgc->idle);
+    uv_prepare_start(&lgc->prepare, lgc_on_prepare);
+  }
+  lgc->step = luaL_optint(L, 1, 0);
+  lgc->ceiling = luaL_optint(L, 2, 0);
+  lgc->threshold = 2 * lua_gc(LLL, LUA_GCCOUNT, 0);
+  lua_gc(LLL, LUA_GCSTOP, 0);
+  return 0;
+}
+
+// gc_stats() -> { steps, cycles, forced, time (ms), count (KB) }
+static int l_gc_stats(lua_State *L)
+{
+  lua_createtable(L, 0, 5);
+  if (lgc) {
+    lua_pushnumber(L, lgc->steps);
+    lua_setfield(L, -2, "steps");
+    lua_pushnumber(L, lgc->cycles);
+    lua_setfield(L, -2, "cycles");
+    lua_pushnumber(L, lgc->forced);
+    lua_setfield(L, -2, "forced");
+    lua_pushnumber(L, lgc->time / 1e6);
+    lua_setfield(L, -2, "time");
+  }
+  lua_pushinteger(L, lua_gc(L, LUA_GCCOUNT, 0));
+  lua_setfield(L, -2, "count");
+  return 1;
+}
+
+// slab_stats() -> { hits, misses, large, frees, pages } of small object
+// allocator, if the state uses it
+static int l_slab_stats(lua_State *L)
+{
+  const slab_stats_t *stats = slab_stats();
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, stats->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, stats->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, stats->large);
+  lua_setfield(L, -2, "large");
+  lua_pushnumber(L, stats->frees);
+  lua_setfield(L, -2, "frees");
+  lua_pushnumber(L, stats->pages);
+  lua_setfield(L, -2, "pages");
+  return 1;
+}
+
 /******************************************************************************/
 /* module
 /******************************************************************************/
@@ -307,9 +1811,24 @@ static int l_run(lua_State *L) {
 static const luaL_Reg exports[] = {
   { "make_server", l_make_server },
   { "send", l_send },
+  { "headers", l_headers },
+  { "buffer", l_buffer },
   { "finish", l_end },
+  { "body_mode", l_body_mode },
+  { "sleep", l_sleep },
+  { "read_body", l_read_body },
+  { "read_file", l_read_file },
   { "delay", l_delay },
   { "msg", l_msg },
+  { "header", l_header },
+  { "status_line", l_status_line },
+  { "date", l_date },
+  { "work_pool", l_work_pool },
+  { "work", l_work },
+  { "watchdog_stats", l_watchdog_stats },
+  { "gc_schedule", l_gc_schedule },
+  { "gc_stats", l_gc_stats },
+  { "slab_stats", l_slab_stats },
   { "run", l_run },
   { NULL, NULL }
 };
@@ -318,58 +1837,51 @@ LUALIB_API int luaopen_luv(lua_State *L) {
 
   LLL = L;
 
-  STATUS_CODES[100] = "Continue";
-  STATUS_CODES[101] = "Switching Protocols";
-  STATUS_CODES[102] = "Processing";             // RFC 2518; obsoleted by RFC 4918
-  STATUS_CODES[200] = "OK";
-  STATUS_CODES[201] = "Created";
-  STATUS_CODES[202] = "Accepted";
-  STATUS_CODES[203] = "Non-Authoritative Information";
-  STATUS_CODES[204] = "No Content";
-  STATUS_CODES[205] = "Reset Content";
-  STATUS_CODES[206] = "Partial Content";
-  STATUS_CODES[207] = "Multi-Status";               // RFC 4918
-  STATUS_CODES[300] = "Multiple Choices";
-  STATUS_CODES[301] = "Moved Permanently";
-  STATUS_CODES[302] = "Moved Temporarily";
-  STATUS_CODES[303] = "See Other";
-  STATUS_CODES[304] = "Not Modified";
-  STATUS_CODES[305] = "Use Proxy";
-  STATUS_CODES[307] = "Temporary Redirect";
-  STATUS_CODES[400] = "Bad Request";
-  STATUS_CODES[401] = "Unauthorized";
-  STATUS_CODES[402] = "Payment Required";
-  STATUS_CODES[403] = "Forbidden";
-  STATUS_CODES[404] = "Not Found";
-  STATUS_CODES[405] = "Method Not Allowed";
-  STATUS_CODES[406] = "Not Acceptable";
-  STATUS_CODES[407] = "Proxy Authentication Required";
-  STATUS_CODES[408] = "Request Time-out";
-  STATUS_CODES[409] = "Conflict";
-  STATUS_CODES[410] = "Gone";
-  STATUS_CODES[411] = "Length Required";
-  STATUS_CODES[412] = "Precondition Failed";
-  STATUS_CODES[413] = "Request Entity Too Large";
-  STATUS_CODES[414] = "Request-URI Too Large";
-  STATUS_CODES[415] = "Unsupported Media Type";
-  STATUS_CODES[416] = "Requested Range Not Satisfiable";
-  STATUS_CODES[417] = "Expectation Failed";
-  STATUS_CODES[418] = "I'm a teapot";               // RFC 2324
-  STATUS_CODES[422] = "Unprocessable Entity";       // RFC 4918
-  STATUS_CODES[423] = "Locked";                     // RFC 4918
-  STATUS_CODES[424] = "Failed Dependency";          // RFC 4918
-  STATUS_CODES[425] = "Unordered Collection";       // RFC 4918
-  STATUS_CODES[426] = "Upgrade Required";           // RFC 2817
-  STATUS_CODES[500] = "Internal Server Error";
-  STATUS_CODES[501] = "Not Implemented";
-  STATUS_CODES[502] = "Bad Gateway";
-  STATUS_CODES[503] = "Service Unavailable";
-  STATUS_CODES[504] = "Gateway Time-out";
-  STATUS_CODES[505] = "HTTP Version not supported";
-  STATUS_CODES[506] = "Variant Also Negotiates";    // RFC 2295
-  STATUS_CODES[507] = "Insufficient Storage";       // RFC 4918
-  STATUS_CODES[509] = "Bandwidth Limit Exceeded";
-  STATUS_CODES[510] = "Not Extended";               // RFC 2774
+  luaL_newmetatable(L, "uhttp.headers");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "uhttp.timer");
+  lua_newtable(L);
+  lua_pushcfunction(L, l_timer_stop);
+  lua_setfield(L, -2, "stop");
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "uhttp.buffer");
+  lua_newtable(L);
+  luaL_register(L, NULL, buffer_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, l_buffer_len);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, l_buffer_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, l_buffer_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  // interned strings
+  {
+  int i;
+  lua_createtable(L, HEADER_MAX, 0);
+  for (i = 0; i < HEADER_MAX; ++i) {
+    lua_pushstring(L, header_name(i));
+    lua_rawseti(L, -2, i + 1);
+  }
+  HEADER_NAMES_REF = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newtable(L);
+  METHODS_REF = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  luaL_newmetatable(L, "uhttp.msg");
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  EMPTY_ENV_REF = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newtable(L);
+  lua_pushcfunction(L, l_header);
+  lua_setfield(L, -2, "header");
+  lua_pushcclosure(L, l_msg_index, 2); // upvalues: empty env, methods
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
 
   /* module table */
   lua_newtable(L);
@@ -392,6 +1904,12 @@ LUALIB_API int luaopen_luv(lua_State *L) {
   lua_setfield(L, -2, "CLOSE");
   lua_pushinteger(L, EVT_MESSAGE);
   lua_setfield(L, -2, "MESSAGE");
+  lua_pushinteger(L, BODY_STREAM);
+  lua_setfield(L, -2, "BODY_STREAM");
+  lua_pushinteger(L, BODY_BUFFER);
+  lua_setfield(L, -2, "BODY_BUFFER");
+  lua_pushinteger(L, BODY_DISCARD);
+  lua_setfield(L, -2, "BODY_DISCARD");
 
   return 1;
 }
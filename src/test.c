@@ -21,6 +21,9 @@
 #define RESPONSE_BODY \
   "Hello\n"
 
+#define URL_IS(msg, s) \
+  ((msg)->url.len == sizeof(s) - 1 && memcmp((msg)->url.base, s, (msg)->url.len) == 0)
+
 static void timer_on_close(uv_handle_t *timer)
 {
   free((void *)timer);
@@ -32,13 +35,13 @@ static void timer_on_timeout(uv_timer_t *timer, int status)
   msg_t *msg = timer->data;
   response_write(msg, RESPONSE_HEAD, 38);
   msg->headers_sent = 1;
-  if (strcmp(msg->heap.base, "/1") == 0) {
+  if (URL_IS(msg, "/1")) {
     response_write(msg, "[111]\n", 6);
-  } else if (strcmp(msg->heap.base, "/2") == 0) {
+  } else if (URL_IS(msg, "/2")) {
     response_write(msg, "[222]\n", 6);
-  } else if (strcmp(msg->heap.base, "/3") == 0) {
+  } else if (URL_IS(msg, "/3")) {
     response_write(msg, "[333]\n", 6);
-  } else if (strcmp(msg->heap.base, "/4") == 0) {
+  } else if (URL_IS(msg, "/4")) {
     response_write(msg, "[444]\n", 6);
   } else {
     response_write(msg, RESPONSE_BODY, 6);
@@ -60,6 +63,13 @@ static void client_on_event(client_t *self, msg_t *msg, enum event_t ev, int sta
     DEBUGF("RDATA %p %*s", msg, status, (char *)data);
   } else if (ev == EVT_REQUEST) {
     DEBUGF("CREQ %p", self);
+    // answer before the body arrives, see test/early
+    if (URL_IS(msg, "/early")) {
+      msg->body_mode = BODY_DISCARD;
+      response_write(msg, RESPONSE_HEAD "[555]\n", 44);
+      msg->headers_sent = 1;
+      response_end(msg);
+    }
   } else if (ev == EVT_SHUT) {
     DEBUGF("CEND %p", self);
   } else if (ev == EVT_OPEN) {
@@ -70,17 +80,19 @@ static void client_on_event(client_t *self, msg_t *msg, enum event_t ev, int sta
     DEBUGF("CERROR %p %d %s", self, status, (char *)data);
   } else if (ev == EVT_END) {
     DEBUGF("REND %p", msg);
+    // answered already
+    if (URL_IS(msg, "/early")) return;
 #ifdef DELAY_RESPONSE
     uv_timer_t *timer = malloc(sizeof(*timer));
     timer->data = msg;
     uv_timer_init(self->handle.loop, timer);
-    if (strcmp(msg->heap.base, "/1") == 0) {
+    if (URL_IS(msg, "/1")) {
       uv_timer_start(timer, timer_on_timeout, 2 * DELAY_RESPONSE, 0);
-    } else if (strcmp(msg->heap.base, "/2") == 0) {
+    } else if (URL_IS(msg, "/2")) {
       uv_timer_start(timer, timer_on_timeout, 0 * DELAY_RESPONSE, 0);
-    } else if (strcmp(msg->heap.base, "/3") == 0) {
+    } else if (URL_IS(msg, "/3")) {
       uv_timer_start(timer, timer_on_timeout, 3 * DELAY_RESPONSE, 0);
-    } else if (strcmp(msg->heap.base, "/4") == 0) {
+    } else if (URL_IS(msg, "/4")) {
       uv_timer_start(timer, timer_on_timeout, 1 * DELAY_RESPONSE, 0);
     } else {
       uv_timer_start(timer, timer_on_timeout, DELAY_RESPONSE, 0);
@@ -95,14 +107,24 @@ static void client_on_event(client_t *self, msg_t *msg, enum event_t ev, int sta
   }
 }
 
-int main()
+int main(int argc, char *argv[])
 {
   uv_loop_t *loop = uv_default_loop();
+  // number of loop threads, 0 to serve from the main thread
+  int nthreads = argc > 1 ? atoi(argv[1]) : 0;
 
   // N.B. let libuv catch EPIPE
   signal(SIGPIPE, SIG_IGN);
 
-  uv_tcp_t *server = server_init(8080, "0.0.0.0", 1024, client_on_event);
+  if (nthreads > 0) {
+    server_threads_t *threads = server_init_threads(8080, "0.0.0.0", 1024,
+        client_on_event, nthreads, NULL);
+    // block until workers exit
+    server_join_threads(threads);
+    return 0;
+  }
+
+  server_t *server = server_init(8080, "0.0.0.0", 1024, client_on_event, NULL);
 
   // REPL?
 
@@ -1,31 +1,87 @@
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/socket.h>
+#ifdef UHTTP_FAST_PARSER
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#endif
 
 #include "uhttp.h"
 
+// N.B. older libc headers lack it, value is the same on all Linux arches
+// but for a few exotic ones
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
 /******************************************************************************/
 /* utility
 /******************************************************************************/
 
-static uv_err_t last_err()
+// N.B. errors are per loop, and there may be a loop per thread
+static uv_err_t last_err(uv_loop_t *loop)
 {
-  return uv_last_error(uv_default_loop());
+  return uv_last_error(loop);
+}
+
+static int CHECK(uv_loop_t *loop, const char *msg, int status) {
+  if (status == -1) {
+    fprintf(stderr, "%s: %s\n", msg, uv_strerror(last_err(loop)));
+    exit(-1);
+  }
+  return status;
 }
 
-static int CHECK(const char *msg, int status) {
+// same for system calls, which report errors via errno
+static int CHECK_SYS(const char *msg, int status) {
   if (status == -1) {
-    fprintf(stderr, "%s: %s\n", msg, uv_strerror(last_err()));
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
     exit(-1);
   }
   return status;
 }
 
+/*
+ * canned responses
+ */
+
+#define RESPONSE_413 \
+  "HTTP/1.1 413 Request Entity Too Large\r\n" \
+  "Connection: close\r\n" \
+  "Content-Length: 0\r\n" \
+  "\r\n"
+
+#define RESPONSE_414 \
+  "HTTP/1.1 414 Request-URI Too Large\r\n" \
+  "Connection: close\r\n" \
+  "Content-Length: 0\r\n" \
+  "\r\n"
+
+#define RESPONSE_431 \
+  "HTTP/1.1 431 Request Header Fields Too Large\r\n" \
+  "Connection: close\r\n" \
+  "Content-Length: 0\r\n" \
+  "\r\n"
+
 /*
  * https://github.com/joyent/libuv/blob/master/test/benchmark-pump.c#L294-326
  */
 
 
+/*
+ * N.B. allocators below keep per-thread freelists, so that each loop thread
+ * recycles its own requests, buffers, messages and clients without locking.
+ * An object must be freed by the thread which runs its loop.
+ */
+
 /*
  * Request allocator
  */
@@ -35,7 +91,7 @@ typedef struct req_list_s {
   struct req_list_s *next;
 } req_list_t;
 
-static req_list_t *req_freelist = NULL;
+static __thread req_list_t *req_freelist = NULL;
 
 static uv_req_t *req_alloc() {
   req_list_t *req;
@@ -61,14 +117,20 @@ static void req_free(uv_req_t *uv_req) {
  * Buffer allocator
  */
 
+/*
+ * N.B. buffers are reference counted: messages keep slices of the read
+ * buffer their head was parsed from
+ */
+
 typedef struct buf_list_s {
   uv_buf_t uv_buf_t;
+  int refs;
   struct buf_list_s *next;
 } buf_list_t;
 
-static buf_list_t *buf_freelist = NULL;
+static __thread buf_list_t *buf_freelist = NULL;
 
-static int NB = 0;
+static __thread int NB = 0;
 
 static uv_buf_t buf_alloc(uv_handle_t *handle, size_t size) {
   buf_list_t *buf;
@@ -76,6 +138,7 @@ static uv_buf_t buf_alloc(uv_handle_t *handle, size_t size) {
   buf = buf_freelist;
   if (buf != NULL) {
     buf_freelist = buf->next;
+    buf->refs = 1;
     return buf->uv_buf_t;
   }
 
@@ -83,17 +146,63 @@ static uv_buf_t buf_alloc(uv_handle_t *handle, size_t size) {
   printf("BUFALLOC %d\n", ++NB);
   buf->uv_buf_t.len = size;
   buf->uv_buf_t.base = ((char *) buf) + sizeof *buf;
+  buf->refs = 1;
 
   return buf->uv_buf_t;
 }
 
+static void buf_ref(uv_buf_t uv_buf_t) {
+  buf_list_t *buf = (buf_list_t *) (uv_buf_t.base - sizeof *buf);
+
+  ++buf->refs;
+}
+
 static void buf_free(uv_buf_t uv_buf_t) {
   buf_list_t *buf = (buf_list_t *) (uv_buf_t.base - sizeof *buf);
 
+  if (--buf->refs > 0) return;
   buf->next = buf_freelist;
   buf_freelist = buf;
 }
 
+/*
+ * Header arena allocator.
+ * Arenas hold request heads spanning several reads
+ */
+
+typedef struct arena_list_s {
+  size_t size;
+  struct arena_list_s *next;
+} arena_list_t;
+
+static __thread arena_list_t *arena_freelist = NULL;
+
+static char *arena_alloc(size_t size) {
+  arena_list_t *arena;
+
+  arena = arena_freelist;
+  if (arena != NULL) {
+    arena_freelist = arena->next;
+    if (arena->size >= size) {
+      return ((char *) arena) + sizeof *arena;
+    }
+    // max header size changed? reallocate
+    free(arena);
+  }
+
+  arena = (arena_list_t *) malloc(size + sizeof *arena);
+  if (!arena) return NULL;
+  arena->size = size;
+  return ((char *) arena) + sizeof *arena;
+}
+
+static void arena_free(char *base) {
+  arena_list_t *arena = (arena_list_t *) (base - sizeof *arena);
+
+  arena->next = arena_freelist;
+  arena_freelist = arena;
+}
+
 /*
  * HTTP message allocator
  */
@@ -103,9 +212,9 @@ typedef struct msg_list_s {
   struct msg_list_s *next;
 } msg_list_t;
 
-static msg_list_t *msg_freelist = NULL;
+static __thread msg_list_t *msg_freelist = NULL;
 
-static int NM = 0;
+static __thread int NM = 0;
 
 static msg_t *msg_alloc() {
   msg_list_t *msg;
@@ -128,6 +237,38 @@ static void msg_free(msg_t *msg) {
   msg_freelist = m;
 }
 
+/*
+ * Spilled iovec allocator.
+ * Arrays of MSG_POOL_NBUFS are recycled, larger ones come from malloc
+ */
+
+typedef union iov_list_u {
+  uv_buf_t bufs[MSG_POOL_NBUFS];
+  union iov_list_u *next;
+} iov_list_t;
+
+static __thread iov_list_t *iov_freelist = NULL;
+
+static uv_buf_t *iov_alloc() {
+  iov_list_t *iov;
+
+  iov = iov_freelist;
+  if (iov != NULL) {
+    iov_freelist = iov->next;
+    return (uv_buf_t *)iov;
+  }
+
+  iov = (iov_list_t *)malloc(sizeof *iov);
+  return (uv_buf_t *)iov;
+}
+
+static void iov_free(uv_buf_t *bufs) {
+  iov_list_t *iov = (iov_list_t *)bufs;
+
+  iov->next = iov_freelist;
+  iov_freelist = iov;
+}
+
 /***
 static void x_free(void **list)
 {
@@ -147,9 +288,9 @@ typedef struct client_list_s {
   struct client_list_s *next;
 } client_list_t;
 
-static client_list_t *client_freelist = NULL;
+static __thread client_list_t *client_freelist = NULL;
 
-static int NC = 0;
+static __thread int NC = 0;
 
 static client_t *client_alloc() {
   client_list_t *client;
@@ -172,20 +313,243 @@ static void client_free(client_t *client) {
   client_freelist = l;
 }
 
+/*
+ * Small object allocator.
+ * Size classes of SLAB_ALIGN bytes up to SLAB_MAX, each with own freelist.
+ * Objects are carved from pages which are never given back. Callers pass
+ * the size of freed object, as lua_Alloc does, so objects carry no header
+ */
+
+#define SLAB_CLASSES (SLAB_MAX / SLAB_ALIGN)
+
+typedef struct slab_list_s {
+  struct slab_list_s *next;
+} slab_list_t;
+
+static __thread slab_list_t *slab_freelists[SLAB_CLASSES];
+static __thread char *slab_page = NULL; // uncarved rest of the page
+static __thread size_t slab_page_left = 0;
+static __thread slab_stats_t slab_stats_;
+
+static void *slab_alloc(size_t size) {
+  int cls = (size - 1) / SLAB_ALIGN;
+  slab_list_t *obj;
+
+  obj = slab_freelists[cls];
+  if (obj != NULL) {
+    slab_freelists[cls] = obj->next;
+    ++slab_stats_.hits;
+    return obj;
+  }
+
+  size = (cls + 1) * SLAB_ALIGN;
+  if (slab_page_left < size) {
+    // N.B. the rest of old page is lost
+    slab_page = malloc(SLAB_PAGE_SIZE);
+    if (!slab_page) {
+      slab_page_left = 0;
+      return NULL;
+    }
+    slab_page_left = SLAB_PAGE_SIZE;
+    ++slab_stats_.pages;
+  }
+  obj = (slab_list_t *)slab_page;
+  slab_page += size;
+  slab_page_left -= size;
+  ++slab_stats_.misses;
+  return obj;
+}
+
+static void slab_free(void *ptr, size_t size) {
+  int cls = (size - 1) / SLAB_ALIGN;
+  slab_list_t *obj = ptr;
+
+  obj->next = slab_freelists[cls];
+  slab_freelists[cls] = obj;
+  ++slab_stats_.frees;
+}
+
+void *slab_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+  void *p;
+  // free
+  if (nsize == 0) {
+    if (!ptr) return NULL;
+    if (osize <= SLAB_MAX) {
+      slab_free(ptr, osize);
+    } else {
+      free(ptr);
+    }
+    return NULL;
+  }
+  // both large? let malloc move it
+  if (ptr && osize > SLAB_MAX && nsize > SLAB_MAX) {
+    ++slab_stats_.large;
+    return realloc(ptr, nsize);
+  }
+  // same size class? nothing to do
+  if (ptr && osize <= SLAB_MAX && nsize <= SLAB_MAX
+      && (osize - 1) / SLAB_ALIGN == (nsize - 1) / SLAB_ALIGN)
+  {
+    return ptr;
+  }
+  if (nsize <= SLAB_MAX) {
+    p = slab_alloc(nsize);
+  } else {
+    ++slab_stats_.large;
+    p = malloc(nsize);
+  }
+  // N.B. on failure original block is kept, as Lua expects
+  if (!p || !ptr) return p;
+  memcpy(p, ptr, osize < nsize ? osize : nsize);
+  if (osize <= SLAB_MAX) {
+    slab_free(ptr, osize);
+  } else {
+    free(ptr);
+  }
+  return p;
+}
+
+const slab_stats_t *slab_stats(void)
+{
+  return &slab_stats_;
+}
+
+/******************************************************************************/
+/* Timer wheel
+/******************************************************************************/
+
+/*
+ * Coarse timers for connection timeouts and the like.
+ * Timers hash into slots by expiration tick, so (re)arming is a couple of
+ * pointer moves. A single uv timer per loop walks the slots.
+ * N.B. there is one loop per thread, so the wheel is per thread
+ */
+
+typedef struct {
+  uv_loop_t *loop;
+  uv_timer_t timer;
+  uint64_t tick; // last processed tick
+  size_t count; // armed timers
+  wheel_timer_t slots[WHEEL_SLOTS]; // list heads
+} wheel_t;
+
+static __thread wheel_t *wheel = NULL;
+
+static void wheel_on_tick(uv_timer_t *timer, int status);
+
+static wheel_t *wheel_get(uv_loop_t *loop)
+{
+  int i;
+  if (wheel) {
+    assert(wheel->loop == loop);
+    return wheel;
+  }
+  wheel = calloc(1, sizeof(*wheel));
+  assert(wheel);
+  wheel->loop = loop;
+  wheel->tick = uv_now(loop) / WHEEL_TICK;
+  for (i = 0; i < WHEEL_SLOTS; ++i) {
+    wheel->slots[i].next = wheel->slots[i].prev = &wheel->slots[i];
+  }
+  uv_timer_init(loop, &wheel->timer);
+  return wheel;
+}
+
+static void wheel_link(wheel_t *w, wheel_timer_t *t)
+{
+  wheel_timer_t *head = &w->slots[t->expire & (WHEEL_SLOTS - 1)];
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+static void wheel_unlink(wheel_timer_t *t)
+{
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+}
+
+// fire timer callback in timeout milliseconds, rounded up to tick.
+// N.B. restarts armed timer
+void wheel_start(uv_loop_t *loop, wheel_timer_t *t, wheel_cb cb,
+    uint64_t timeout)
+{
+  wheel_t *w = wheel_get(loop);
+  if (t->next) {
+    wheel_unlink(t);
+  } else if (w->count++ == 0) {
+    // first timer, start ticking
+    w->tick = uv_now(loop) / WHEEL_TICK;
+    uv_timer_start(&w->timer, wheel_on_tick, WHEEL_TICK, WHEEL_TICK);
+  }
+  t->cb = cb;
+  t->expire = (uv_now(loop) + timeout + WHEEL_TICK - 1) / WHEEL_TICK;
+  // N.B. never expire in the past, slot is processed once per turn
+  if (t->expire <= w->tick) t->expire = w->tick + 1;
+  wheel_link(w, t);
+}
+
+// disarm timer. N.B. stopping stopped timer is ok
+void wheel_stop(wheel_timer_t *t)
+{
+  if (!t->next) return;
+  wheel_unlink(t);
+  if (--wheel->count == 0) {
+    uv_timer_stop(&wheel->timer);
+  }
+}
+
+static void wheel_on_tick(uv_timer_t *timer, int status)
+{
+  wheel_t *w = wheel;
+  uint64_t now = uv_now(w->loop) / WHEEL_TICK;
+  wheel_timer_t pending, *t, *head;
+  int n = 0;
+  // process slots of ticks elapsed since last time
+  while (w->tick < now && n++ < WHEEL_SLOTS) {
+    ++w->tick;
+    head = &w->slots[w->tick & (WHEEL_SLOTS - 1)];
+    if (head->next == head) continue;
+    // detach the slot, so that callbacks can rearm timers freely
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = pending.prev->next = &pending;
+    head->next = head->prev = head;
+    while ((t = pending.next) != &pending) {
+      wheel_unlink(t);
+      // expires in later turn of the wheel? put back
+      if (t->expire > now) {
+        wheel_link(w, t);
+        continue;
+      }
+      if (--w->count == 0) {
+        uv_timer_stop(&w->timer);
+      }
+      t->cb(t);
+    }
+  }
+  w->tick = now;
+}
+
 /******************************************************************************/
 /* TCP client methods
 /******************************************************************************/
 
-static void client_on_timeout(uv_timer_t *timer, int status);
+static void client_on_timeout(wheel_timer_t *timer);
+static void client_unqueue(client_t *self);
 static void response_free(msg_t *self);
 
 // set close timeout. N.B. start/stop is idempotent
 static void client_timeout(client_t *self, uint64_t timeout)
 {
   if (!timeout) {
-    uv_timer_stop(&self->timer_timeout);
+    wheel_stop(&self->timeout);
   } else {
-    uv_timer_start(&self->timer_timeout, client_on_timeout, timeout, 0);
+    wheel_start(self->server->handle.loop, &self->timeout, client_on_timeout,
+        timeout);
   }
 }
 
@@ -195,11 +559,22 @@ static void client_after_close(uv_handle_t *handle)
   client_t *self = handle->data;
   assert(self);
   // dispose close timer
-  if (!uv_is_closing((uv_handle_t *)&self->timer_timeout)) {
-    uv_close((uv_handle_t *)&self->timer_timeout, NULL);
+  client_timeout(self, 0);
+  // release unparsed data, if any
+  if (self->pending.base) {
+    buf_free(self->pending);
+    self->pending.base = NULL;
   }
+  // free unwritten responses, if any
+  msg_t *p, *prev;
+  client_unqueue(self);
+  for (p = self->flush_head; p; p = prev) {
+    prev = p->flush_next;
+    response_free(p);
+  }
+  self->flush_head = self->flush_tail = NULL;
   // free pending responses, if any
-  msg_t *p = self->msg, *prev;
+  p = self->msg;
   self->msg = NULL;
   if (p) {
     assert(!p->next);
@@ -212,13 +587,13 @@ static void client_after_close(uv_handle_t *handle)
     }
   }
   // fire 'close' event
-  EVENT(self, NULL, EVT_CLOSE, last_err().code, NULL);
+  EVENT(self, NULL, EVT_CLOSE, last_err(handle->loop).code, NULL);
   // free self
   client_free(self);
 }
 
 // shutdown and close the client
-static void client_close(client_t *self)
+void client_close(client_t *self)
 {
   assert(self);
   // sanity check
@@ -235,7 +610,7 @@ static void client_after_shutdown(uv_shutdown_t *rq, int status)
   client_t *self = rq->data;
   req_free((uv_req_t *)rq);
   // fire 'shut' event
-  EVENT(self, self->msg, EVT_SHUT, last_err().code, NULL);
+  EVENT(self, self->msg, EVT_SHUT, last_err(self->handle.loop).code, NULL);
   // close the handle
   client_close(self);
 }
@@ -256,7 +631,7 @@ static void client_shutdown(client_t *self)
 }
 
 // async: client close timer expired
-static void client_on_timeout(uv_timer_t *timer, int status)
+static void client_on_timeout(wheel_timer_t *timer)
 {
   client_t *self = (client_t *)timer->data;
   // close the client
@@ -267,30 +642,284 @@ static void client_on_timeout(uv_timer_t *timer, int status)
 /* HTTP parser
 /******************************************************************************/
 
-static int message_begin_cb(http_parser *parser)
+static msg_t *message_begin(client_t *client)
 {
-  client_t *client = parser->data;
-  assert(client);
   // allocate message
   msg_t *msg = msg_alloc();
   assert(msg);
-  memset(msg, 0, sizeof(*msg));
+  memset(msg, 0, offsetof(msg_t, headers));
+  msg->bufs = msg->bufs_inline;
+  msg->bufs_size = MSG_NBUFS;
   // set message's client
   msg->client = client;
-  // store links to previous message, if any
+  // store links to previous message, if any.
+  // N.B. finished message without previous one is already being flushed
   msg->prev = client->msg;
+  if (msg->prev && msg->prev->finished && !msg->prev->prev) {
+    msg->prev = NULL;
+  }
   assert(msg != msg->prev);
   if (msg != msg->prev) {
     // this message is the next one for the current message
     if (msg->prev) msg->prev->next = msg;
   }
-  // allocate message heap
-  // N.B. size should equal uv's buffer size
-  msg->heap = buf_alloc(NULL, 64 * 1024);
-  memset(msg->heap.base, 0, 64 * 1024);
-  msg->heap.len = 0;
   //
   client->msg = msg;
+  ++client->nmsgs;
+  msg->body_mode = client->server->config.body_mode;
+  return msg;
+}
+
+static void message_index_field(msg_t *msg);
+
+// request head is parsed. if body follows, it should arrive in time,
+// otherwise the handler should respond in time
+static void message_headers_complete(client_t *client, msg_t *msg, int body)
+{
+  msg->headers_complete = 1;
+  // last header may have empty value
+  message_index_field(msg);
+  client_timeout(client, body ?
+      client->server->config.body_timeout :
+      client->server->config.handler_timeout);
+  // run 'request' handler
+  EVENT(client, msg, EVT_REQUEST, 0, NULL);
+}
+
+// no more requests are accepted until some responses are written
+static int client_pipeline_full(client_t *client)
+{
+  size_t max = client->server->config.max_pipeline;
+  return max && client->nmsgs >= max;
+}
+
+static int message_begin_cb(http_parser *parser)
+{
+  client_t *client = parser->data;
+  assert(client);
+  client->parsing = 1;
+  message_begin(client);
+  // request head should arrive in time
+  client_timeout(client, client->server->config.header_timeout);
+  return 0;
+}
+
+// lower case ASCII letters in place, a word at a time
+static void lowercase(char *s, size_t len)
+{
+  size_t i = 0;
+  uint64_t w, h, upper;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&w, s + i, 8);
+    h = w & 0x7f7f7f7f7f7f7f7fULL;
+    // high bit of a byte is set iff 'A' <= byte <= 'Z'
+    upper = ((h + 0x3f3f3f3f3f3f3f3fULL) ^ (h + 0x2525252525252525ULL))
+        & ~w & 0x8080808080808080ULL;
+    w |= upper >> 2;
+    memcpy(s + i, &w, 8);
+  }
+  for (; i < len; ++i) {
+    if ((unsigned char)(s[i] - 'A') < 26) s[i] |= 0x20;
+  }
+}
+
+/*
+ * Known headers.
+ * Perfect hash of lower cased names, see header_hash()
+ */
+
+static const struct {
+  const char *name;
+  size_t len;
+} header_names[HEADER_MAX] = {
+#define X(s) { s, sizeof(s) - 1 }
+  X("accept"),
+  X("accept-encoding"),
+  X("accept-language"),
+  X("authorization"),
+  X("cache-control"),
+  X("connection"),
+  X("content-length"),
+  X("content-type"),
+  X("cookie"),
+  X("expect"),
+  X("host"),
+  X("if-modified-since"),
+  X("if-none-match"),
+  X("origin"),
+  X("range"),
+  X("referer"),
+  X("transfer-encoding"),
+  X("upgrade"),
+  X("user-agent"),
+  X("x-forwarded-for"),
+#undef X
+};
+
+// hash slot -> 1-based header_id, 0 if empty
+static const unsigned char header_slots[32] = {
+   0,  1,  0, 20,  0,  0,  3, 15, 12, 16,  5,  6, 11, 10,  0,  7,
+   0, 19,  0,  0,  4,  0,  2,  0,  0, 17, 18, 14, 13,  8,  0,  9
+};
+
+// N.B. constants are chosen so that known names do not collide.
+// update header_slots when the set changes
+#define header_hash(s, len) \
+  (((unsigned char)(s)[0] * 3 + (unsigned char)(s)[(len) - 1] * 24 \
+      + (len) * 5) & 31)
+
+// id of known header, -1 if unknown. name should be lower cased
+int header_id(const char *name, size_t len)
+{
+  int id;
+  if (!len) return -1;
+  id = header_slots[header_hash(name, len)] - 1;
+  if (id >= 0 && header_names[id].len == len
+      && memcmp(header_names[id].name, name, len) == 0) {
+    return id;
+  }
+  return -1;
+}
+
+// lower cased name of known header
+const char *header_name(int id)
+{
+  return id >= 0 && id < HEADER_MAX ? header_names[id].name : NULL;
+}
+
+// value of request header, NULL if absent. name should be lower cased
+const uv_buf_t *msg_header(const msg_t *msg, const char *name)
+{
+  return msg_header_len(msg, name, strlen(name));
+}
+
+const uv_buf_t *msg_header_len(const msg_t *msg, const char *name, size_t len)
+{
+  size_t i;
+  int id = header_id(name, len);
+  if (id >= 0) return MSG_HEADER(msg, id);
+  for (i = 0; i < msg->nheaders; ++i) {
+    const header_t *h = &msg->headers[i];
+    if (h->name.len == len && memcmp(h->name.base, name, len) == 0) {
+      return &h->value;
+    }
+  }
+  return NULL;
+}
+
+enum {
+  TOKEN_NONE = 0,
+  TOKEN_URL,
+  TOKEN_FIELD,
+  TOKEN_VALUE
+};
+
+// header name which was the last token is complete, index it if known.
+// N.B. first occurence wins
+static void message_index_field(msg_t *msg)
+{
+  if (msg->last_token != TOKEN_FIELD) return;
+  const uv_buf_t *name = &msg->headers[msg->nheaders - 1].name;
+  int id = header_id(name->base, name->len);
+  if (id >= 0 && !msg->known[id]) {
+    msg->known[id] = msg->nheaders;
+  }
+}
+
+// record a slice of request head.
+// N.B. http_parser reports a token split across reads as one more chunk
+// of the same kind at the start of the next read
+static int message_token(client_t *client, int kind, const char *p, size_t len)
+{
+  msg_t *msg = client->msg;
+  uv_buf_t *token;
+
+  // trailers of message answered and freed early? ignore
+  if (!msg) return 0;
+
+  // check limits
+  msg->head_len += len;
+  if (msg->head_len > client->server->config.max_header_size) {
+    msg->reject = kind == TOKEN_URL ? 414 : 431;
+    return -1;
+  }
+
+  // lower case header names in the read buffer
+  if (kind == TOKEN_FIELD) {
+    lowercase((char *)p, len);
+  }
+
+  // continuation of the current token?
+  if (kind == msg->last_token && p == client->rbuf.base) {
+    token = kind == TOKEN_URL ? &msg->url
+        : kind == TOKEN_FIELD ? &msg->headers[msg->nheaders - 1].name
+        : &msg->headers[msg->nheaders - 1].value;
+    // beginning of the token was moved to the arena tail, glue the rest
+    assert(msg->arena);
+    assert(token->base + token->len == msg->arena + msg->arena_len);
+    memcpy(msg->arena + msg->arena_len, p, len);
+    msg->arena_len += len;
+    token->len += len;
+    return 0;
+  }
+
+  // new token. N.B. header name ends with a value, or with the next name
+  // or the head, as empty value is not reported by parser
+  message_index_field(msg);
+  if (kind == TOKEN_URL) {
+    token = &msg->url;
+  } else if (kind == TOKEN_FIELD) {
+    if (msg->nheaders == MSG_MAX_HEADERS) {
+      msg->reject = 431;
+      return -1;
+    }
+    token = &msg->headers[msg->nheaders++].name;
+    token[1].base = "";
+    token[1].len = 0;
+  } else {
+    token = &msg->headers[msg->nheaders - 1].value;
+  }
+  token->base = (char *)p;
+  token->len = len;
+  msg->last_token = kind;
+
+  // hold the read buffer
+  if (!msg->rbuf.base) {
+    msg->rbuf = client->rbuf;
+    buf_ref(msg->rbuf);
+  }
+
+  return 0;
+}
+
+// move the slices of incomplete head out of the read buffer
+static int message_compact(msg_t *msg)
+{
+  size_t i;
+  uv_buf_t *token;
+  const char *start = msg->rbuf.base, *end = start + msg->rbuf.len;
+
+  if (!msg->rbuf.base) return 0;
+
+  if (!msg->arena) {
+    msg->arena = arena_alloc(msg->client->server->config.max_header_size);
+    if (!msg->arena) return -1;
+  }
+  // N.B. copy in order, so that the last token ends at arena tail
+  for (i = 0; i <= 2 * msg->nheaders; ++i) {
+    token = i == 0 ? &msg->url
+        : (i & 1) ? &msg->headers[(i - 1) / 2].name
+        : &msg->headers[(i - 1) / 2].value;
+    if (token->base >= start && token->base < end) {
+      memcpy(msg->arena + msg->arena_len, token->base, token->len);
+      token->base = msg->arena + msg->arena_len;
+      msg->arena_len += token->len;
+    }
+  }
+
+  // release the read buffer
+  buf_free(msg->rbuf);
+  msg->rbuf.base = NULL;
   return 0;
 }
 
@@ -298,48 +927,24 @@ static int url_cb(http_parser *parser, const char *p, size_t len)
 {
   client_t *client = parser->data;
   assert(client);
-  msg_t *msg = client->msg;
-  assert(msg);
   // memo URL
-  // TODO: fix overflow!
-  strncat(msg->heap.base, p, len);
-  msg->heap.len += len;
-  return 0;
+  return message_token(client, TOKEN_URL, p, len);
 }
 
 static int header_field_cb(http_parser *parser, const char *p, size_t len)
 {
   client_t *client = parser->data;
   assert(client);
-  msg_t *msg = client->msg;
-  assert(msg);
   // memo header name
-  // TODO: fix overflow!
-  int new = (parser->state == 47 && msg->heap.len) ? 1 : 0; // s_header_field?
-  {
-  // lower case and append to the heap
-  size_t i;
-  char *s = msg->heap.base + msg->heap.len + new;
-  for (i = 0; i < len; ++i) *s++ = tolower(p[i]);
-  *s++ = '\0';
-  }
-  msg->heap.len += len + new;
-  return 0;
+  return message_token(client, TOKEN_FIELD, p, len);
 }
 
 static int header_value_cb(http_parser *parser, const char *p, size_t len)
 {
   client_t *client = parser->data;
   assert(client);
-  msg_t *msg = client->msg;
-  assert(msg);
   // memo header value
-  // TODO: fix overflow!
-  int new = parser->state == 50 ? 1 : 0; // s_header_value?
-  // append to the heap
-  strncat(msg->heap.base + msg->heap.len + new, p, len);
-  msg->heap.len += len + new;
-  return 0;
+  return message_token(client, TOKEN_VALUE, p, len);
 }
 
 static int headers_complete_cb(http_parser *parser)
@@ -351,13 +956,54 @@ static int headers_complete_cb(http_parser *parser)
   // copy parser info
   msg->method = http_method_str(parser->method);
   msg->should_keep_alive = http_should_keep_alive(parser);
-  // message is keep-alive, stop close timer
-  if (msg->should_keep_alive) {
-    client_timeout(msg->client, 0);
+  // declared body is too large? reject before the handler sees the request
+  size_t max_body_size = client->server->config.max_body_size;
+  if (msg->body_mode == BODY_BUFFER) {
+    size_t max = client->server->config.max_buffered_body;
+    if (!max_body_size || max < max_body_size) max_body_size = max;
   }
-  // run 'request' handler
-  EVENT(client, msg, EVT_REQUEST, 0, NULL);
-  return 0; // 1 to skip body!
+  if (max_body_size && parser->content_length > 0 &&
+      (uint64_t)parser->content_length > max_body_size)
+  {
+    msg->reject = 413;
+    return -1;
+  }
+  message_headers_complete(client, msg,
+      parser->content_length > 0 || (parser->flags & F_CHUNKED));
+  // body of known length is to be buffered? allocate once.
+  // N.B. handler may have changed body mode
+  if (msg->body_mode == BODY_BUFFER && parser->content_length > 0
+      && (uint64_t)parser->content_length
+          <= client->server->config.max_buffered_body)
+  {
+    msg->body.base = malloc(parser->content_length);
+    if (msg->body.base) msg->body_size = parser->content_length;
+  }
+  // N.B. returning 1 to skip body is for responses to HEAD. for requests
+  // it makes the body be parsed as the next request, so discarded body is
+  // dropped in body_cb
+  return 0;
+}
+
+// append body chunk to buffered body
+static int message_buffer_body(client_t *client, msg_t *msg,
+    const char *p, size_t len)
+{
+  size_t size = msg->body_size;
+  if (msg->body.len + len > client->server->config.max_buffered_body) {
+    return -1;
+  }
+  if (msg->body.len + len > size) {
+    if (!size) size = 4096;
+    while (size < msg->body.len + len) size *= 2;
+    char *base = realloc(msg->body.base, size);
+    if (!base) return -1;
+    msg->body.base = base;
+    msg->body_size = size;
+  }
+  memcpy(msg->body.base + msg->body.len, p, len);
+  msg->body.len += len;
+  return 0;
 }
 
 static int body_cb(http_parser *parser, const char *p, size_t len)
@@ -365,9 +1011,33 @@ static int body_cb(http_parser *parser, const char *p, size_t len)
   client_t *client = parser->data;
   assert(client);
   msg_t *msg = client->msg;
-  assert(msg);
-  // pump message body via 'data' events
-  EVENT(client, msg, EVT_DATA, len, (void *)p);
+  // handler answered before body arrived, and the message is freed?
+  // drop the rest of body
+  if (!msg) {
+    client_timeout(client, client->server->config.body_timeout);
+    return 0;
+  }
+  // body grew too large? handler has seen the request, so
+  // treat as parse error
+  msg->body_len += len;
+  size_t max_body_size = client->server->config.max_body_size;
+  if (max_body_size && msg->body_len > max_body_size) {
+    return -1;
+  }
+  // next chunk should arrive in time
+  client_timeout(client, client->server->config.body_timeout);
+  switch (msg->body_mode) {
+    case BODY_DISCARD:
+      break;
+    // accumulate, deliver with 'end' event.
+    // N.B. too large body is a parse error, as the handler has seen
+    // the request
+    case BODY_BUFFER:
+      return message_buffer_body(client, msg, p, len);
+    // pump message body via 'data' events
+    default:
+      EVENT(client, msg, EVT_DATA, len, (void *)p);
+  }
   return 0;
 }
 
@@ -388,50 +1058,370 @@ static int message_complete_cb(http_parser *parser)
   client_t *client = parser->data;
   assert(client);
   msg_t *msg = client->msg;
-  assert(msg);
+  client->parsing = 0;
   // reset parser
   http_parser_execute(parser, &parser_settings, NULL, 0);
-  // fire 'end' event
-  EVENT(client, msg, EVT_END, 0, NULL);
+  // message answered and freed while its body was arriving?
+  if (!msg) {
+    if (!client->nmsgs) {
+      client_timeout(client, client->server->config.keepalive_timeout);
+    }
+    return 0;
+  }
+  // handler should respond in time, unless it already has
+  if (!msg->finished) {
+    client_timeout(client, client->server->config.handler_timeout);
+  }
+  // too many requests in flight? stop parsing until responses drain
+  if (client_pipeline_full(client)) {
+    client->paused = 1;
+    http_parser_pause(parser, 1);
+  }
+  // fire 'end' event. buffered body, if any, goes with it
+  EVENT(client, msg, EVT_END, msg->body.len, msg->body.base);
   return 0;
 }
 
+#ifdef UHTTP_FAST_PARSER
+
 /******************************************************************************/
-/* HTTP client reader
+/* Fast HTTP request parser
 /******************************************************************************/
 
-static void client_on_read(uv_stream_t *handle, ssize_t nread, uv_buf_t buf)
-{
-  client_t *self = handle->data;
-  assert(self);
-  msg_t *msg = self->msg;
+/*
+ * Parses requests which are completely in the buffer and have no body,
+ * in one pass and without per token callbacks.
+ * Anything else is left to http_parser
+ */
 
-  if (nread > 0) {
-    // once in "upgrade" mode, the protocol is no longer HTTP
-    // and data should bypass parser
-    if (msg && msg->upgrade) {
-      assert("junk" == NULL);
-      EVENT(self, msg, EVT_DATA, nread, buf.base);
-    } else {
-      size_t nparsed = http_parser_execute(
-          &self->parser, &parser_settings, buf.base, nread
-        );
-      if (nparsed < nread) {
-        // reset parser
-        http_parser_execute(&self->parser, &parser_settings, NULL, 0);
-        // report parse error
-        if (msg) {
-          EVENT(self, msg, EVT_ERROR, UV_UNKNOWN, NULL);
-        }
-        // just close the client
-        client_close(self);
+typedef struct {
+  const char *name;
+  size_t name_len;
+  const char *value;
+  size_t value_len;
+} fast_header_t;
+
+typedef struct {
+  enum http_method method;
+  int keep_alive;
+  const char *url;
+  size_t url_len;
+  size_t nheaders;
+  fast_header_t headers[MSG_MAX_HEADERS];
+} fast_request_t;
+
+// byte ranges which stop scanning of request tokens
+static const char url_stop[16] = { 0x00, ' ', 0x7f, 0x7f };
+static const char name_stop[16] = {
+  0x00, ' ', '"', '"', '(', ')', ',', ',', '/', '/', ':', '@', '[', ']',
+  0x7f, (char)0xff
+};
+// N.B. tab is allowed in values
+static const char value_stop[16] = { 0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f };
+
+// first byte of [p, end) which falls in ranges, or end
+static const char *fast_find(const char *p, const char *end,
+    const char *ranges, int nranges)
+{
+#ifdef __SSE4_2__
+  __m128i r = _mm_loadu_si128((const __m128i *)ranges);
+  while (end - p >= 16) {
+    int i = _mm_cmpestri(r, nranges,
+        _mm_loadu_si128((const __m128i *)p), 16,
+        _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+    if (i != 16) return p + i;
+    p += 16;
+  }
+#endif
+  for (; p < end; ++p) {
+    unsigned char c = *p;
+    int i;
+    for (i = 0; i < nranges; i += 2) {
+      if (c >= (unsigned char)ranges[i] && c <= (unsigned char)ranges[i + 1]) {
+        return p;
       }
     }
+  }
+  return end;
+}
+
+// end of request head, i.e. past "\r\n\r\n", or NULL
+static const char *fast_head_end(const char *p, const char *end)
+{
+  unsigned mask;
+  int i;
+#if defined(__AVX2__)
+  const __m256i cr = _mm256_set1_epi8('\r');
+  while (end - p >= 32 + 3) {
+    mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        _mm256_loadu_si256((const __m256i *)p), cr));
+    while (mask) {
+      i = __builtin_ctz(mask);
+      if (p[i + 1] == '\n' && p[i + 2] == '\r' && p[i + 3] == '\n') {
+        return p + i + 4;
+      }
+      mask &= mask - 1;
+    }
+    p += 32;
+  }
+#elif defined(__SSE2__)
+  const __m128i cr = _mm_set1_epi8('\r');
+  while (end - p >= 16 + 3) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *)p), cr));
+    while (mask) {
+      i = __builtin_ctz(mask);
+      if (p[i + 1] == '\n' && p[i + 2] == '\r' && p[i + 3] == '\n') {
+        return p + i + 4;
+      }
+      mask &= mask - 1;
+    }
+    p += 16;
+  }
+#endif
+  for (; end - p >= 4; ++p) {
+    if (p[0] == '\r' && p[1] == '\n' && p[2] == '\r' && p[3] == '\n') {
+      return p + 4;
+    }
+  }
+  return NULL;
+}
+
+#define FAST_IS(p, len, s) \
+  ((len) == sizeof(s) - 1 && strncasecmp((p), s, sizeof(s) - 1) == 0)
+
+// tokenize request head. returns head length,
+// or 0 if the request is incomplete or should go to http_parser
+static size_t fast_scan(const char *buf, size_t len, size_t max,
+    fast_request_t *req)
+{
+  const char *p = buf, *q, *end;
+  fast_header_t *h;
+
+  // find end of head. N.B. head is known to be complete below
+  end = fast_head_end(buf, buf + (len < max ? len : max));
+  if (!end || end - buf < (int)sizeof("GET / HTTP/1.1\r\n\r\n") - 1) return 0;
+
+  // method
+  if (memcmp(p, "GET ", 4) == 0) {
+    req->method = HTTP_GET;
+    p += 4;
+  } else if (memcmp(p, "HEAD ", 5) == 0) {
+    req->method = HTTP_HEAD;
+    p += 5;
+  } else {
+    return 0;
+  }
+
+  // url
+  q = fast_find(p, end, url_stop, 4);
+  if (q == p || *q != ' ') return 0;
+  req->url = p;
+  req->url_len = q - p;
+  p = q + 1;
+
+  // version
+  if (end - p < 10 || memcmp(p, "HTTP/1.", 7) != 0
+      || (p[7] != '0' && p[7] != '1') || p[8] != '\r' || p[9] != '\n') {
+    return 0;
+  }
+  req->keep_alive = p[7] == '1';
+  p += 10;
+
+  // headers
+  req->nheaders = 0;
+  while (*p != '\r') {
+    if (req->nheaders == MSG_MAX_HEADERS) return 0;
+    h = &req->headers[req->nheaders++];
+    // name. N.B. folded lines stop here
+    q = fast_find(p, end, name_stop, 16);
+    if (q == p || *q != ':') return 0;
+    h->name = p;
+    h->name_len = q - p;
+    // value, trimmed
+    p = q + 1;
+    while (*p == ' ' || *p == '\t') ++p;
+    q = fast_find(p, end, value_stop, 6);
+    if (q[0] != '\r' || q[1] != '\n') return 0;
+    h->value = p;
+    p = q + 2;
+    while (q > h->value && (q[-1] == ' ' || q[-1] == '\t')) --q;
+    h->value_len = q - h->value;
+    // headers changing framing are for http_parser
+    if (FAST_IS(h->name, h->name_len, "connection")) {
+      if (FAST_IS(h->value, h->value_len, "close")) {
+        req->keep_alive = 0;
+      } else if (FAST_IS(h->value, h->value_len, "keep-alive")) {
+        req->keep_alive = 1;
+      } else {
+        return 0;
+      }
+    } else if (FAST_IS(h->name, h->name_len, "content-length")) {
+      if (!FAST_IS(h->value, h->value_len, "0")) return 0;
+    } else if (FAST_IS(h->name, h->name_len, "transfer-encoding")
+        || FAST_IS(h->name, h->name_len, "upgrade")
+        || FAST_IS(h->name, h->name_len, "expect")) {
+      return 0;
+    }
+  }
+  if (p + 2 != end) return 0;
+
+  return end - buf;
+}
+
+// parse complete requests bypassing http_parser.
+// returns number of bytes consumed
+static size_t client_parse_fast(client_t *self, const char *buf, size_t len)
+{
+  fast_request_t req;
+  size_t i, n, nparsed = 0;
+  msg_t *msg;
+
+  // N.B. http_parser owns partially parsed message
+  while (!self->parsing && nparsed < len) {
+    n = fast_scan(buf + nparsed, len - nparsed,
+        self->server->config.max_header_size, &req);
+    if (!n) break;
+    nparsed += n;
+    msg = message_begin(self);
+    // N.B. fast_scan honors limits, tokens are accepted
+    message_token(self, TOKEN_URL, req.url, req.url_len);
+    for (i = 0; i < req.nheaders; ++i) {
+      fast_header_t *h = &req.headers[i];
+      message_token(self, TOKEN_FIELD, h->name, h->name_len);
+      message_token(self, TOKEN_VALUE, h->value, h->value_len);
+    }
+    msg->method = http_method_str(req.method);
+    msg->should_keep_alive = req.keep_alive;
+    message_headers_complete(self, msg, 0);
+    // fire 'end' event
+    EVENT(self, msg, EVT_END, 0, NULL);
+    // no more requests on this connection, the rest is junk
+    if (!req.keep_alive
+        || uv_is_closing((uv_handle_t *)&self->handle)) {
+      return len;
+    }
+    // too many requests in flight? stop parsing until responses drain
+    if (client_pipeline_full(self)) {
+      self->paused = 1;
+      break;
+    }
+  }
+
+  return nparsed;
+}
+
+#endif
+
+/******************************************************************************/
+/* HTTP client reader
+/******************************************************************************/
+
+// answer the request with canned error response, then close the client
+static void client_reject(client_t *self, msg_t *msg)
+{
+  // stop reading, no more requests are accepted
+  uv_read_stop((uv_stream_t *)&self->handle);
+  msg->should_keep_alive = 0;
+  msg->headers_sent = 1;
+  if (msg->reject == 413) {
+    response_write(msg, RESPONSE_413, sizeof(RESPONSE_413) - 1);
+  } else if (msg->reject == 414) {
+    response_write(msg, RESPONSE_414, sizeof(RESPONSE_414) - 1);
+  } else {
+    response_write(msg, RESPONSE_431, sizeof(RESPONSE_431) - 1);
+  }
+  response_end(msg);
+}
+
+// parse read buffer data starting at pos
+static void client_parse(client_t *self, uv_buf_t buf, size_t pos, size_t len)
+{
+  msg_t *msg;
+  size_t nparsed = pos;
+  self->rbuf = buf;
+#ifdef UHTTP_FAST_PARSER
+  if (self->server->fast_parser) {
+    nparsed += client_parse_fast(self, buf.base + nparsed, len - nparsed);
+  }
+  if (nparsed < len && !self->paused)
+#endif
+  nparsed += http_parser_execute(
+      &self->parser, &parser_settings, buf.base + nparsed, len - nparsed
+    );
+  self->rbuf.base = NULL;
+  msg = self->msg;
+  // N.B. callback failing on data which ends the read leaves nothing
+  // unparsed, so the error is seen by parser state only
+  enum http_errno err = HTTP_PARSER_ERRNO(&self->parser);
+  // too many requests in flight? keep the rest until responses drain
+  if (self->paused) {
+    uv_read_stop((uv_stream_t *)&self->handle);
+    if (nparsed < len) {
+      buf_ref(buf);
+      self->pending = buf;
+      self->pending_pos = nparsed;
+      self->pending_len = len;
+    }
+  } else if (err != HPE_OK || nparsed < len) {
+    // reset parser
+    http_parser_execute(&self->parser, &parser_settings, NULL, 0);
+    // request is too large? answer and close
+    if (msg && msg->reject) {
+      client_reject(self, msg);
+    } else {
+      // report parse error
+      if (msg) {
+        EVENT(self, msg, EVT_ERROR, UV_UNKNOWN, NULL);
+      }
+      // just close the client
+      client_close(self);
+    }
+  // request head is incomplete? move it out of the read buffer
+  } else if (msg && !msg->headers_complete && message_compact(msg)) {
+    msg->reject = 431;
+    client_reject(self, msg);
+  }
+}
+
+static void client_on_read(uv_stream_t *handle, ssize_t nread, uv_buf_t buf);
+
+// responses drained, continue with pipelined requests
+static void client_resume(client_t *self)
+{
+  uv_buf_t buf = self->pending;
+  self->paused = 0;
+  http_parser_pause(&self->parser, 0);
+  if (buf.base) {
+    self->pending.base = NULL;
+    client_parse(self, buf, self->pending_pos, self->pending_len);
+    buf_free(buf);
+  }
+  if (!self->paused && !uv_is_closing((uv_handle_t *)&self->handle)) {
+    uv_read_start((uv_stream_t *)&self->handle, buf_alloc, client_on_read);
+  }
+}
+
+static void client_on_read(uv_stream_t *handle, ssize_t nread, uv_buf_t buf)
+{
+  client_t *self = handle->data;
+  assert(self);
+  msg_t *msg = self->msg;
+
+  if (nread > 0) {
+    // once in "upgrade" mode, the protocol is no longer HTTP
+    // and data should bypass parser
+    if (msg && msg->upgrade) {
+      assert("junk" == NULL);
+      EVENT(self, msg, EVT_DATA, nread, buf.base);
+    } else {
+      client_parse(self, buf, 0, nread);
+    }
   // don't route empty chunks to the parser
   } else if (nread == 0) {
   // report read errors
   } else {
-    uv_err_t err = last_err();
+    uv_err_t err = last_err(handle->loop);
     // N.B. must close stream on read error, or libuv assertion fails
     client_close(self);
     if (err.code != UV_EOF && err.code != UV_ECONNRESET) {
@@ -452,23 +1442,22 @@ static void server_on_connection(uv_stream_t *self, int status)
   client_t *client = client_alloc();
   assert(client);
   memset(client, 0, sizeof(*client));
-  client->server = (uv_tcp_t *)self;
-  client->on_event = client->server->data;
+  client->server = self->data;
+  client->on_event = client->server->on_event;
+  client->events = client->server->events;
   client->handle.data = client;
-  client->timer_timeout.data = client;
+  client->timeout.data = client;
   client->parser.data = client;
   EVENT(client, NULL, EVT_OPEN, 0, NULL);
 
-  uv_timer_init(self->loop, &client->timer_timeout);
-  // TODO: de-hardcode
-  // set client initial inactivity timeout to 10 seconds
-  client_timeout(client, 1000);
+  // first request head should arrive in time
+  client_timeout(client, client->server->config.header_timeout);
 
   // accept client
   uv_tcp_init(self->loop, &client->handle);
   // TODO: EMFILE trick!
   // https://github.com/joyent/libuv/blob/master/src/unix/ev/ev.3#L1812-1816
-  CHECK("accept", uv_accept(self, (uv_stream_t *)&client->handle));
+  CHECK(self->loop, "accept", uv_accept(self, (uv_stream_t *)&client->handle));
 
   // initialize HTTP parser
   http_parser_init(&client->parser, HTTP_REQUEST);
@@ -481,76 +1470,829 @@ static void server_on_connection(uv_stream_t *self, int status)
 /* HTTP server
 /******************************************************************************/
 
-uv_tcp_t *server_init(
+void server_config_init(server_config_t *config)
+{
+  memset(config, 0, sizeof(*config));
+  config->header_timeout = SERVER_HEADER_TIMEOUT;
+  config->body_timeout = SERVER_BODY_TIMEOUT;
+  config->keepalive_timeout = SERVER_KEEPALIVE_TIMEOUT;
+  config->handler_timeout = SERVER_HANDLER_TIMEOUT;
+  config->max_header_size = SERVER_MAX_HEADER_SIZE;
+  config->max_pipeline = SERVER_MAX_PIPELINE;
+  config->body_mode = BODY_STREAM;
+  config->max_buffered_body = SERVER_MAX_BUFFERED_BODY;
+}
+
+static server_t *server_new(
+    uv_loop_t *loop,
+    event_cb on_event,
+    const server_config_t *config
+  )
+{
+  server_t *server = calloc(1, sizeof(*server));
+  server->on_event = on_event; // store message event handler
+  server->events = EVENT_ALL;
+  if (config) {
+    server->config = *config;
+  } else {
+    server_config_init(&server->config);
+  }
+#ifdef UHTTP_FAST_PARSER
+  server->fast_parser = 1;
+#endif
+  server->handle.data = server;
+  uv_tcp_init(loop, &server->handle);
+  return server;
+}
+
+server_t *server_listen(
+    uv_loop_t *loop,
     int port,
     const char *host,
     int backlog_size,
-    event_cb on_event
+    event_cb on_event,
+    int reuseport,
+    const server_config_t *config
   )
 {
-  uv_tcp_t *server = calloc(1, sizeof(*server));
-  server->data = on_event; // store message event handler
-  uv_tcp_init(uv_default_loop(), server);
+  server_t *server = server_new(loop, on_event, config);
+  // let several loops listen to the same address.
+  // N.B. option must be set before bind, so we create the socket ourselves
+  // N.B. uv_tcp_open does not make the socket non-blocking, and
+  // a blocking listener stalls the loop in accept()
+  if (reuseport) {
+    int fd = CHECK_SYS("socket", socket(AF_INET, SOCK_STREAM, 0));
+    int on = 1;
+    CHECK_SYS("SO_REUSEPORT",
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)));
+    CHECK_SYS("O_NONBLOCK",
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+    CHECK_SYS("FD_CLOEXEC", fcntl(fd, F_SETFD, FD_CLOEXEC));
+    CHECK(loop, "open", uv_tcp_open(&server->handle, fd));
+  }
   struct sockaddr_in address = uv_ip4_addr(host, port);
-  CHECK("bind", uv_tcp_bind(server, address));
-  CHECK("listen",
-      uv_listen((uv_stream_t *)server, backlog_size, server_on_connection)
+  CHECK(loop, "bind", uv_tcp_bind(&server->handle, address));
+  CHECK(loop, "listen",
+      uv_listen((uv_stream_t *)&server->handle, backlog_size,
+          server_on_connection)
   );
   return server;
 }
 
+// listen to already bound socket, e.g. one inherited from cluster master
+server_t *server_open(
+    uv_loop_t *loop,
+    int fd,
+    int backlog_size,
+    event_cb on_event,
+    const server_config_t *config
+  )
+{
+  server_t *server = server_new(loop, on_event, config);
+  CHECK(loop, "open", uv_tcp_open(&server->handle, fd));
+  CHECK(loop, "listen",
+      uv_listen((uv_stream_t *)&server->handle, backlog_size,
+          server_on_connection)
+  );
+  return server;
+}
+
+server_t *server_init(
+    int port,
+    const char *host,
+    int backlog_size,
+    event_cb on_event,
+    const server_config_t *config
+  )
+{
+  return server_listen(
+      uv_default_loop(), port, host, backlog_size, on_event, 0, config
+    );
+}
+
+/******************************************************************************/
+/* Multi-threaded HTTP server
+/******************************************************************************/
+
+// thread body: own loop, own listener, own allocator pools
+static void server_thread(void *arg)
+{
+  server_threads_t *self = arg;
+  uv_loop_t *loop = uv_loop_new();
+  assert(loop);
+  server_listen(loop, self->port, self->host, self->backlog_size,
+      self->on_event, 1, &self->config);
+  uv_run(loop);
+  uv_loop_delete(loop);
+}
+
+// start nthreads loops, each accepting on its own SO_REUSEPORT socket,
+// so that the kernel balances connections between them
+server_threads_t *server_init_threads(
+    int port,
+    const char *host,
+    int backlog_size,
+    event_cb on_event,
+    int nthreads,
+    const server_config_t *config
+  )
+{
+  assert(nthreads > 0);
+  server_threads_t *self = calloc(1,
+      sizeof(*self) + nthreads * sizeof(uv_thread_t));
+  self->port = port;
+  self->host = host;
+  self->backlog_size = backlog_size;
+  self->on_event = on_event;
+  if (config) {
+    self->config = *config;
+  } else {
+    server_config_init(&self->config);
+  }
+  self->nthreads = nthreads;
+  int i;
+  for (i = 0; i < nthreads; ++i) {
+    if (uv_thread_create(&self->threads[i], server_thread, self)) {
+      fprintf(stderr, "thread: failed to start worker %d\n", i);
+      exit(-1);
+    }
+  }
+  return self;
+}
+
+// block until all server threads exit
+void server_join_threads(server_threads_t *self)
+{
+  int i;
+  for (i = 0; i < self->nthreads; ++i) {
+    uv_thread_join(&self->threads[i]);
+  }
+  free(self);
+}
+
+/******************************************************************************/
+/* Stable accessors
+/******************************************************************************/
+
+/*
+ * Plain functions over opaque messages, so that bindings, e.g. LuaJIT FFI,
+ * need not know structure layouts
+ */
+
+const char *msg_method(const msg_t *msg)
+{
+  return msg->method;
+}
+
+const char *msg_url(const msg_t *msg, size_t *len)
+{
+  *len = msg->url.len;
+  return msg->url.base;
+}
+
+int msg_keep_alive(const msg_t *msg)
+{
+  return msg->should_keep_alive;
+}
+
+size_t msg_nheaders(const msg_t *msg)
+{
+  return msg->nheaders;
+}
+
+const char *msg_header_name(const msg_t *msg, size_t i, size_t *len)
+{
+  if (i >= msg->nheaders) return NULL;
+  *len = msg->headers[i].name.len;
+  return msg->headers[i].name.base;
+}
+
+const char *msg_header_value(const msg_t *msg, size_t i, size_t *len)
+{
+  if (i >= msg->nheaders) return NULL;
+  *len = msg->headers[i].value.len;
+  return msg->headers[i].value.base;
+}
+
+// value of request header by lower cased name, NULL if absent
+const char *msg_header_get(
+    const msg_t *msg,
+    const char *name,
+    size_t name_len,
+    size_t *len
+  )
+{
+  const uv_buf_t *value = msg_header_len(msg, name, name_len);
+  if (!value) return NULL;
+  *len = value->len;
+  return value->base;
+}
+
+/******************************************************************************/
+/* Rope
+/******************************************************************************/
+
+static __thread rope_chunk_t *rope_freelist = NULL;
+
+static rope_chunk_t *rope_chunk_alloc()
+{
+  rope_chunk_t *chunk = rope_freelist;
+  if (chunk != NULL) {
+    rope_freelist = chunk->next;
+  } else {
+    chunk = malloc(sizeof(*chunk));
+    if (!chunk) return NULL;
+  }
+  chunk->next = NULL;
+  chunk->len = 0;
+  return chunk;
+}
+
+// return chunk list to the pool
+static void rope_chunks_free(rope_chunk_t *chunk)
+{
+  rope_chunk_t *next;
+  for (; chunk; chunk = next) {
+    next = chunk->next;
+    chunk->next = rope_freelist;
+    rope_freelist = chunk;
+  }
+}
+
+void rope_init(rope_t *self)
+{
+  self->head = self->tail = NULL;
+  self->len = 0;
+}
+
+// room for at least one byte at the tail
+static rope_chunk_t *rope_tail(rope_t *self)
+{
+  rope_chunk_t *tail = self->tail;
+  if (!tail || tail->len == ROPE_CHUNK_SIZE) {
+    tail = rope_chunk_alloc();
+    if (!tail) return NULL;
+    if (self->tail) {
+      self->tail->next = tail;
+    } else {
+      self->head = tail;
+    }
+    self->tail = tail;
+  }
+  return tail;
+}
+
+int rope_append(rope_t *self, const char *data, size_t len)
+{
+  rope_chunk_t *tail;
+  size_t n;
+  while (len) {
+    tail = rope_tail(self);
+    if (!tail) return -1;
+    n = ROPE_CHUNK_SIZE - tail->len;
+    if (n > len) n = len;
+    memcpy(tail->data + tail->len, data, n);
+    tail->len += n;
+    self->len += n;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int rope_append_escaped(rope_t *self, const char *data, size_t len)
+{
+  size_t i, start = 0;
+  const char *entity;
+  for (i = 0; i < len; ++i) {
+    switch (data[i]) {
+      case '&': entity = "&amp;"; break;
+      case '<': entity = "&lt;"; break;
+      case '>': entity = "&gt;"; break;
+      case '"': entity = "&quot;"; break;
+      case '\'': entity = "&#39;"; break;
+      default: continue;
+    }
+    // flush verbatim run, then the entity
+    if (rope_append(self, data + start, i - start)
+        || rope_append(self, entity, strlen(entity)))
+    {
+      return -1;
+    }
+    start = i + 1;
+  }
+  return rope_append(self, data + start, len - start);
+}
+
+void rope_free(rope_t *self)
+{
+  rope_chunks_free(self->head);
+  rope_init(self);
+}
+
+/******************************************************************************/
+/* HTTP response head fragments
+/******************************************************************************/
+
+/*
+ * Status lines are serialized at compile time.
+ * Date header is serialized once a second by a timer of the loop.
+ * N.B. there is one loop per thread, so the date is per thread
+ */
+
+#define HTTP_STATUS_MAP(XX) \
+  XX(100, "Continue") \
+  XX(101, "Switching Protocols") \
+  XX(102, "Processing") /* RFC 2518; obsoleted by RFC 4918 */ \
+  XX(200, "OK") \
+  XX(201, "Created") \
+  XX(202, "Accepted") \
+  XX(203, "Non-Authoritative Information") \
+  XX(204, "No Content") \
+  XX(205, "Reset Content") \
+  XX(206, "Partial Content") \
+  XX(207, "Multi-Status") /* RFC 4918 */ \
+  XX(300, "Multiple Choices") \
+  XX(301, "Moved Permanently") \
+  XX(302, "Moved Temporarily") \
+  XX(303, "See Other") \
+  XX(304, "Not Modified") \
+  XX(305, "Use Proxy") \
+  XX(307, "Temporary Redirect") \
+  XX(400, "Bad Request") \
+  XX(401, "Unauthorized") \
+  XX(402, "Payment Required") \
+  XX(403, "Forbidden") \
+  XX(404, "Not Found") \
+  XX(405, "Method Not Allowed") \
+  XX(406, "Not Acceptable") \
+  XX(407, "Proxy Authentication Required") \
+  XX(408, "Request Time-out") \
+  XX(409, "Conflict") \
+  XX(410, "Gone") \
+  XX(411, "Length Required") \
+  XX(412, "Precondition Failed") \
+  XX(413, "Request Entity Too Large") \
+  XX(414, "Request-URI Too Large") \
+  XX(415, "Unsupported Media Type") \
+  XX(416, "Requested Range Not Satisfiable") \
+  XX(417, "Expectation Failed") \
+  XX(418, "I'm a teapot") /* RFC 2324 */ \
+  XX(422, "Unprocessable Entity") /* RFC 4918 */ \
+  XX(423, "Locked") /* RFC 4918 */ \
+  XX(424, "Failed Dependency") /* RFC 4918 */ \
+  XX(425, "Unordered Collection") /* RFC 4918 */ \
+  XX(426, "Upgrade Required") /* RFC 2817 */ \
+  XX(431, "Request Header Fields Too Large") /* RFC 6585 */ \
+  XX(500, "Internal Server Error") \
+  XX(501, "Not Implemented") \
+  XX(502, "Bad Gateway") \
+  XX(503, "Service Unavailable") \
+  XX(504, "Gateway Time-out") \
+  XX(505, "HTTP Version not supported") \
+  XX(506, "Variant Also Negotiates") /* RFC 2295 */ \
+  XX(507, "Insufficient Storage") /* RFC 4918 */ \
+  XX(509, "Bandwidth Limit Exceeded") \
+  XX(510, "Not Extended") /* RFC 2774 */
+
+const char *STATUS_CODES[HTTP_STATUS_MAX] = {
+#define XX(code, text) [code] = text,
+  HTTP_STATUS_MAP(XX)
+#undef XX
+};
+
+static const uv_buf_t STATUS_LINES[HTTP_STATUS_MAX] = {
+#define XX(code, text) [code] = { \
+    base : "HTTP/1.1 " #code " " text "\r\n", \
+    len : sizeof("HTTP/1.1 " #code " " text "\r\n") - 1 \
+  },
+  HTTP_STATUS_MAP(XX)
+#undef XX
+};
+
+const uv_buf_t *response_status_line(int code)
+{
+  if (code < 0 || code >= HTTP_STATUS_MAX || !STATUS_LINES[code].base) {
+    return NULL;
+  }
+  return &STATUS_LINES[code];
+}
+
+static const char DIGITS[201] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+// format value in decimal so that it ends right before end.
+// returns pointer to the first digit
+char *format_uint(char *end, uint64_t value)
+{
+  char *p = end;
+  // two digits at a time
+  while (value >= 100) {
+    const char *d = DIGITS + (value % 100) * 2;
+    value /= 100;
+    *--p = d[1];
+    *--p = d[0];
+  }
+  if (value >= 10) {
+    *--p = DIGITS[value * 2 + 1];
+    *--p = DIGITS[value * 2];
+  } else {
+    *--p = '0' + value;
+  }
+  return p;
+}
+
+#define DATE_HEADER_SIZE sizeof("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n")
+
+typedef struct {
+  uv_timer_t timer;
+  // N.B. header is double buffered, so that it is safe to reference
+  // for a second after refresh
+  char headers[2][DATE_HEADER_SIZE];
+  uv_buf_t buf;
+} date_t;
+
+static __thread date_t *date = NULL;
+
+static void date_refresh(uv_timer_t *timer, int status)
+{
+  time_t now = time(NULL);
+  struct tm tm;
+  char *p = date->headers[date->buf.base == date->headers[0]];
+  gmtime_r(&now, &tm);
+  date->buf.len = strftime(p, DATE_HEADER_SIZE,
+      "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+  date->buf.base = p;
+}
+
+const uv_buf_t *response_date(uv_loop_t *loop)
+{
+  if (!date) {
+    date = calloc(1, sizeof(*date));
+    assert(date);
+    date_refresh(NULL, 0);
+    uv_timer_init(loop, &date->timer);
+    uv_timer_start(&date->timer, date_refresh, 1000, 1000);
+    // N.B. refreshing should not keep the loop alive
+    uv_unref((uv_handle_t *)&date->timer);
+  }
+  return &date->buf;
+}
+
+// write cached Date header
+void response_write_date(msg_t *self)
+{
+  const uv_buf_t *date = response_date(self->client->server->handle.loop);
+  response_write(self, date->base, date->len);
+}
+
+// write status line
+void response_write_status(msg_t *self, int code)
+{
+  const uv_buf_t *line = response_status_line(code);
+  if (line) {
+    response_write(self, line->base, line->len);
+  // unknown code? no reason phrase.
+  // N.B. small writes are copied
+  } else {
+    char s[32];
+    response_write(self, s, snprintf(s, sizeof(s), "HTTP/1.1 %d \r\n", code));
+  }
+  self->headers_sent = 1;
+}
+
 /******************************************************************************/
 /* HTTP response methods
 /******************************************************************************/
 
-// write data to the message buffer
-void response_write(msg_t *self, const char *data, size_t len)
+// make room for one more iovec
+static int response_grow(msg_t *self)
+{
+  uv_buf_t *bufs;
+  size_t size = self->bufs_size * 2;
+  // inline -> pooled
+  if (self->bufs == self->bufs_inline) {
+    size = MSG_POOL_NBUFS;
+    bufs = iov_alloc();
+  // pooled -> large
+  } else if (self->bufs_size == MSG_POOL_NBUFS) {
+    bufs = malloc(size * sizeof(*bufs));
+  // large -> larger
+  } else {
+    bufs = realloc(self->bufs, size * sizeof(*bufs));
+    if (!bufs) return -1;
+    self->bufs = bufs;
+    self->bufs_size = size;
+    return 0;
+  }
+  if (!bufs) return -1;
+  memcpy(bufs, self->bufs, self->nbufs * sizeof(*bufs));
+  if (self->bufs != self->bufs_inline) iov_free(self->bufs);
+  self->bufs = bufs;
+  self->bufs_size = size;
+  return 0;
+}
+
+// stable storage for a small write
+static char *response_scratch(msg_t *self, size_t len)
+{
+  char *base = self->scratch;
+  size_t size = MSG_SCRATCH_SIZE;
+  char *p;
+  if (self->overflow) {
+    base = self->overflow + sizeof(char *);
+    size = self->overflow_size;
+  }
+  // no room? chain overflow block
+  if (self->scratch_len + len > size) {
+    size = self->client->server->config.max_header_size;
+    if (size < MSG_SCRATCH_SIZE) size = MSG_SCRATCH_SIZE;
+    p = arena_alloc(size);
+    if (!p) return NULL;
+    *(char **)p = self->overflow;
+    self->overflow = p;
+    self->overflow_size = size - sizeof(char *);
+    self->scratch_len = 0;
+    base = p + sizeof(char *);
+  }
+  p = base + self->scratch_len;
+  self->scratch_len += len;
+  return p;
+}
+
+// no memory for the response. body length is likely sent already, so
+// the rest can not be just dropped. close the connection
+static int response_fail(msg_t *self)
+{
+  client_close(self->client);
+  return -1;
+}
+
+// write data to the message buffer.
+// N.B. small chunks are copied, larger ones must live until write is done
+int response_write(msg_t *self, const char *data, size_t len)
 {
   assert(self);
-  if (!self->finished) {
+  int copied = 0;
+  if (!self->finished && len) {
     // TODO: HEAD should void body
   //printf("WRITE %*s\n", len, data);
-    // TODO: overflow
-    uv_buf_t *buf = &self->bufs[self->nbufs++];
+    uv_buf_t *buf = self->nbufs ? &self->bufs[self->nbufs - 1] : NULL;
+    // small chunk? copy to scratch buffer
+    if (len <= MSG_SMALL_WRITE) {
+      char *p = response_scratch(self, len);
+      if (!p) return response_fail(self);
+      memcpy(p, data, len);
+      // previous chunk ends where this one starts? coalesce
+      if (buf && buf->base + buf->len == p) {
+        buf->len += len;
+        return 0;
+      }
+      data = p;
+      copied = 1;
+    }
+    if (self->nbufs == self->bufs_size && response_grow(self)) {
+      return response_fail(self);
+    }
+    buf = &self->bufs[self->nbufs++];
     buf->base = (char *)data;
     buf->len = len;
+    return !copied;
   }
+  return 0;
+}
+
+// write data copying it, for callers which can not keep it alive
+int response_write_copy(msg_t *self, const char *data, size_t len)
+{
+  rope_t rope;
+  if (len <= MSG_SMALL_WRITE) {
+    return response_write(self, data, len) < 0 ? -1 : 0;
+  }
+  rope_init(&rope);
+  if (rope_append(&rope, data, len)) {
+    rope_free(&rope);
+    return response_fail(self);
+  }
+  return response_write_rope(self, &rope);
+}
+
+int response_write_rope(msg_t *self, rope_t *rope)
+{
+  rope_chunk_t *chunk;
+  int status = 0;
+  if (self->finished) return 0;
+  for (chunk = rope->head; chunk; chunk = chunk->next) {
+    if (response_write(self, chunk->data, chunk->len) < 0) {
+      status = -1;
+      break;
+    }
+  }
+  // chunks live until the message is freed
+  if (rope->tail) {
+    rope->tail->next = self->chunks;
+    self->chunks = rope->head;
+  }
+  rope_init(rope);
+  return status;
 }
 
 static void response_free(msg_t *self)
 {
   assert(self);
   //DEBUGF("RFREE %p", self);
+  // let user release its data
+  if (self->client->server->on_msg_free) {
+    self->client->server->on_msg_free(self);
+  }
   // this is the last message?
   if (self->client->msg == self) {
     self->client->msg = NULL;
   }
+  --self->client->nmsgs;
   // TODO: cleanup cleaner
-  buf_free(self->heap);
+  // release request head storage
+  if (self->rbuf.base) buf_free(self->rbuf);
+  if (self->arena) arena_free(self->arena);
+  // release buffered body
+  free(self->body.base);
+  // release rope chunks
+  rope_chunks_free(self->chunks);
+  // release scratch overflow blocks
+  while (self->overflow) {
+    char *next = *(char **)self->overflow;
+    arena_free(self->overflow);
+    self->overflow = next;
+  }
+  // dispose spilled iovecs
+  if (self->bufs != self->bufs_inline) {
+    if (self->bufs_size == MSG_POOL_NBUFS) {
+      iov_free(self->bufs);
+    } else {
+      free(self->bufs);
+    }
+  }
   msg_free(self);
 }
 
 // async: write is done
+// N.B. write may carry several responses
 static void response_client_after_write(uv_write_t *rq, int status)
 {
-  msg_t *msg = rq->data;
+  msg_t *msg = rq->data, *next;
+  client_t *client = msg->client;
+  uv_stream_t *handle = (uv_stream_t *)&client->handle;
+  int keep_alive = 1;
   req_free((uv_req_t *)rq);
   // write failed? report error
   if (status) {
-    uv_stream_t *handle = (uv_stream_t *)&msg->client->handle;
-printf("WRITEERROR %d WRITABLE?: %d FD: %d\n", last_err().code, uv_is_writable(handle), handle->fd);
-    EVENT(msg->client, msg, EVT_ERROR, last_err().code, NULL);
-  // write succeeded? handle keep-alive
+printf("WRITEERROR %d WRITABLE?: %d FD: %d\n", last_err(handle->loop).code, uv_is_writable(handle), handle->fd);
+  }
+  for (; msg; msg = next) {
+    next = msg->flush_next;
+    if (status) {
+      EVENT(client, msg, EVT_ERROR, last_err(handle->loop).code, NULL);
+    } else if (!msg->should_keep_alive) {
+      keep_alive = 0;
+    }
+    // free message
+    response_free(msg);
+  }
+  if (status) return;
+  // client is not keep-alive? we're done
+  if (!keep_alive) {
+    client_shutdown(client);
+    return;
+  }
+  // client is keep-alive, set keep-alive timeout once no request is
+  // in flight
+  if (!client->msg && !client->parsing) {
+    client_timeout(client, client->server->config.keepalive_timeout);
+  }
+  // pipeline drained? accept more requests
+  if (client->paused && !client_pipeline_full(client)) {
+    client_resume(client);
+  }
+}
+
+/*
+ * Responses finished during loop iteration are written at its end,
+ * all responses of a client in one vectored write.
+ * N.B. there is one loop per thread, so the flusher is per thread
+ */
+
+typedef struct {
+  uv_check_t check; // flushes after I/O is polled
+  uv_idle_t idle; // keeps poll from blocking while there is work
+  client_t *clients; // clients having responses to flush
+  uv_buf_t *iov; // gathered buffers
+  size_t iov_size;
+} flusher_t;
+
+static __thread flusher_t *flusher = NULL;
+
+// write all queued responses of the client
+static void client_flush(client_t *self)
+{
+  msg_t *head = self->flush_head, *p;
+  uv_stream_t *handle = (uv_stream_t *)&self->handle;
+  uv_buf_t *bufs;
+  size_t nbufs;
+  self->flush_head = self->flush_tail = NULL;
+  if (!head) return;
+  // write only to writable stream
+  // FIXME: should not snoop into the handle!
+  if (handle->fd < 0 || uv_is_closing((uv_handle_t *)handle)) {
+    // stream is invalid? just cleanup messages
+    for (; head; head = p) {
+      p = head->flush_next;
+printf("JUSTFREE %p %d %d\n", head, head->finished, head->headers_sent);
+      response_free(head);
+    }
+    return;
+  }
+  // single response? write its buffers as is
+  if (!head->flush_next) {
+    bufs = head->bufs;
+    nbufs = head->nbufs;
+  // gather buffers of all responses.
+  // N.B. uv_write copies the array, so it is reused
   } else {
-    // client is keep-alive, set keep-alive timeout upon request completion
-    if (msg->should_keep_alive) {
-      client_timeout(msg->client, 500);
-    } else {
-      client_shutdown(msg->client);
+    nbufs = 0;
+    for (p = head; p; p = p->flush_next) nbufs += p->nbufs;
+    if (nbufs > flusher->iov_size) {
+      free(flusher->iov);
+      flusher->iov_size = nbufs * 2;
+      flusher->iov = malloc(flusher->iov_size * sizeof(uv_buf_t));
+      assert(flusher->iov);
+    }
+    bufs = flusher->iov;
+    for (p = head; p; p = p->flush_next) {
+      memcpy(bufs, p->bufs, p->nbufs * sizeof(uv_buf_t));
+      bufs += p->nbufs;
     }
+    bufs = flusher->iov;
+  }
+  // create write request
+  uv_write_t *rq = (uv_write_t *)req_alloc();
+  rq->data = head;
+  // write buffers
+  if (uv_write(rq, handle, bufs, nbufs, response_client_after_write)) {
+    response_client_after_write(rq, -1);
   }
-  // free message
-  response_free(msg);
+}
+
+static void flusher_on_check(uv_check_t *handle, int status)
+{
+  client_t *client;
+  // N.B. flushing may queue more clients
+  while ((client = flusher->clients)) {
+    flusher->clients = client->flush_next;
+    client->flush_next = NULL;
+    client->flush_queued = 0;
+    client_flush(client);
+  }
+  uv_check_stop(&flusher->check);
+  uv_idle_stop(&flusher->idle);
+}
+
+static void flusher_on_idle(uv_idle_t *handle, int status)
+{
+}
+
+// schedule the client to be flushed at the end of loop iteration
+static void client_queue(client_t *self)
+{
+  if (self->flush_queued) return;
+  if (!flusher) {
+    uv_loop_t *loop = self->server->handle.loop;
+    flusher = calloc(1, sizeof(*flusher));
+    assert(flusher);
+    uv_check_init(loop, &flusher->check);
+    uv_idle_init(loop, &flusher->idle);
+  }
+  if (!flusher->clients) {
+    uv_check_start(&flusher->check, flusher_on_check);
+    uv_idle_start(&flusher->idle, flusher_on_idle);
+  }
+  self->flush_queued = 1;
+  self->flush_next = flusher->clients;
+  flusher->clients = self;
+}
+
+// cancel scheduled flush
+static void client_unqueue(client_t *self)
+{
+  client_t **p;
+  if (!self->flush_queued) return;
+  for (p = &flusher->clients; *p != self; p = &(*p)->flush_next);
+  *p = self->flush_next;
+  self->flush_next = NULL;
+  self->flush_queued = 0;
 }
 
 // flush message buffer to the client
@@ -571,38 +2313,47 @@ printf("ALREADY FINISHED %p\n", self);
   }
   // yes! pipeline ok
   if (!p->prev) {
-    // flush the buffers of all previous messages.
-    // flush all next finished messages as well
+    // queue the buffers of all previous messages.
+    // queue all next finished messages as well
+    client_t *client = p->client;
     msg_t *next;
     while (p && p->finished) {
       next = p->next;
       p->prev = p->next = NULL;
       // unlink the message
       if (next) next->prev = NULL;
-      // write message buffers
       assert(p->headers_sent);
-      uv_stream_t *handle = (uv_stream_t *)&p->client->handle;
-      // write only to writable stream
-      // FIXME: should not snoop into the handle!
-      if (handle->fd >= 0 && !uv_is_closing((uv_handle_t *)handle)) {
-        // stop close timer
-        client_timeout(p->client, 0);
-        // create write request
-        uv_write_t *rq = (uv_write_t *)req_alloc();
-        rq->data = p;
-        // write buffers
-        if (uv_write(rq, handle, p->bufs, p->nbufs,
-            response_client_after_write))
-        {
-          response_client_after_write(rq, -1);
-        }
-      // stream is invalid? just cleanup message
+      // append to the client's write queue
+      if (client->flush_tail) {
+        client->flush_tail->flush_next = p;
       } else {
-printf("JUSTFREE %p %d %d\n", p, p->finished, p->headers_sent);
-        response_free(p);
+        client->flush_head = p;
       }
-      // try to flush next message
+      client->flush_tail = p;
+      // try to queue next message
       p = next;
     }
+    // write at the end of loop iteration
+    client_queue(client);
+  }
+}
+
+void response_abort(msg_t *self, int code)
+{
+  static const char headers[] =
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+  if (self->finished) return;
+  // response is half written? nothing sane can follow
+  if (self->headers_sent || self->nbufs || self->scratch_len) {
+    client_close(self->client);
+    return;
   }
+  // stop reading, no more requests are accepted
+  uv_read_stop((uv_stream_t *)&self->client->handle);
+  self->should_keep_alive = 0;
+  response_write_status(self, code);
+  response_write(self, headers, sizeof(headers) - 1);
+  response_end(self);
 }
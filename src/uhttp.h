@@ -4,8 +4,112 @@
 #include "common.h"
 #include "http_parser.h"
 
+// number of inline response iovecs
+#define MSG_NBUFS 8
+// number of iovecs in pooled spill arrays
+#define MSG_POOL_NBUFS 64
+// writes up to this size are copied to the message scratch buffer
+#define MSG_SMALL_WRITE 128
+#define MSG_SCRATCH_SIZE 512
+// max number of request headers, more are answered with 431
+#define MSG_MAX_HEADERS 32
+// default max size of request URL and headers, see server_t
+#define SERVER_MAX_HEADER_SIZE (8 * 1024)
+
+// default timeouts, ms
+#define SERVER_HEADER_TIMEOUT 10000
+#define SERVER_BODY_TIMEOUT 10000
+#define SERVER_KEEPALIVE_TIMEOUT 500
+#define SERVER_HANDLER_TIMEOUT 0
+
+// status codes are below this
+#define HTTP_STATUS_MAX 600
+
+// default max size of request body buffered in memory
+#define SERVER_MAX_BUFFERED_BODY (1024 * 1024)
+
+// default max number of requests in flight per connection
+#define SERVER_MAX_PIPELINE 16
+
+// size of rope chunk data
+#define ROPE_CHUNK_SIZE (4 * 1024 - 2 * sizeof(void *))
+
 typedef struct client_s client_t;
 typedef struct msg_s msg_t;
+typedef struct server_s server_t;
+
+// list of pooled chunks to build response bodies without reallocations
+typedef struct rope_chunk_s rope_chunk_t;
+
+struct rope_chunk_s {
+  rope_chunk_t *next;
+  size_t len;
+  char data[ROPE_CHUNK_SIZE];
+};
+
+typedef struct {
+  rope_chunk_t *head, *tail;
+  size_t len;
+} rope_t;
+
+typedef struct {
+  uv_buf_t name; // lower cased
+  uv_buf_t value;
+} header_t;
+
+// known headers, indexed on parse
+enum header_id {
+  HEADER_ACCEPT,
+  HEADER_ACCEPT_ENCODING,
+  HEADER_ACCEPT_LANGUAGE,
+  HEADER_AUTHORIZATION,
+  HEADER_CACHE_CONTROL,
+  HEADER_CONNECTION,
+  HEADER_CONTENT_LENGTH,
+  HEADER_CONTENT_TYPE,
+  HEADER_COOKIE,
+  HEADER_EXPECT,
+  HEADER_HOST,
+  HEADER_IF_MODIFIED_SINCE,
+  HEADER_IF_NONE_MATCH,
+  HEADER_ORIGIN,
+  HEADER_RANGE,
+  HEADER_REFERER,
+  HEADER_TRANSFER_ENCODING,
+  HEADER_UPGRADE,
+  HEADER_USER_AGENT,
+  HEADER_X_FORWARDED_FOR,
+  HEADER_MAX
+};
+
+// timer wheel tick, ms
+#define WHEEL_TICK 10
+// number of wheel slots, power of 2
+#define WHEEL_SLOTS 1024
+
+typedef struct wheel_timer_s wheel_timer_t;
+typedef void (*wheel_cb)(wheel_timer_t *timer);
+
+struct wheel_timer_s {
+  wheel_timer_t *prev, *next; // N.B. next is NULL when not armed
+  uint64_t expire; // tick
+  wheel_cb cb;
+  void *data;
+};
+
+// small object allocator: max object size, size class granularity
+#define SLAB_MAX 256
+#define SLAB_ALIGN 16
+// size of pages small objects are carved from
+#define SLAB_PAGE_SIZE (64 * 1024)
+
+typedef struct {
+  uint64_t hits; // small allocations served from freelists
+  uint64_t misses; // small allocations carved from new pages
+  uint64_t large; // allocations passed to malloc
+  uint64_t frees; // small objects returned to freelists
+  size_t pages; // number of pages allocated
+} slab_stats_t;
 
 typedef void (*callback_t)(int status);
 typedef void (*event_cb)(client_t *self, msg_t *msg, enum event_t ev,
@@ -23,31 +127,219 @@ struct msg_s {
   int has_content_length : 1;
   int has_transfer_encoding : 1;
   int finished : 1;
-  uv_buf_t heap;
-  // TODO: reconsider? malloc/realloc?
+  int headers_complete : 1;
+  // request head. URL and headers are slices of the read buffer,
+  // or of the arena if the head spans several reads
+  uv_buf_t url;
+  size_t nheaders;
+  // 1-based indices of known headers in headers, 0 if absent
+  unsigned char known[HEADER_MAX];
+  msg_t *flush_next; // next message in the same write
+  uv_buf_t rbuf; // referenced read buffer
+  char *arena;
+  size_t arena_len;
+  size_t head_len;
+  int last_token;
+  int reject; // status code to reject the request with
+  uint64_t body_len; // request body received so far
+  // how request body is delivered, may be changed in 'request' handler
+  int body_mode;
+  uv_buf_t body; // buffered request body
+  size_t body_size;
+  // response iovecs. start inline, spill to pooled array when exhausted
+  uv_buf_t *bufs;
   size_t nbufs;
-  uv_buf_t bufs[128];
+  size_t bufs_size;
+  size_t scratch_len;
+  // chain of scratch overflow blocks, the first word links the next one
+  char *overflow;
+  size_t overflow_size;
+  rope_chunk_t *chunks; // rope chunks being written
+  void *data; // user data, e.g. reference to objects to keep until free
+  // N.B. fields below are not cleared on message allocation
+  header_t headers[MSG_MAX_HEADERS];
+  uv_buf_t bufs_inline[MSG_NBUFS];
+  // small writes are copied here and coalesced into one iovec
+  char scratch[MSG_SCRATCH_SIZE];
 };
 
 struct client_s {
   uv_tcp_t handle;
-  uv_timer_t timer_timeout; // inactivity close timer
+  wheel_timer_t timeout; // inactivity close timer
   http_parser parser;
+  int parsing; // http_parser is in the middle of a message
   msg_t *msg; // current message http_parser deals with
+  size_t nmsgs; // messages in flight
+  uv_buf_t rbuf; // read buffer http_parser deals with
+  int paused; // too many messages in flight, reading is stopped
+  uv_buf_t pending; // unparsed tail of the read buffer, while paused
+  size_t pending_pos, pending_len;
+  // finished responses to be written at once at the end of loop iteration
+  msg_t *flush_head, *flush_tail;
+  client_t *flush_next; // next client having responses to flush
+  int flush_queued;
   event_cb on_event;
+  unsigned events; // mask of events to fire
   // LUA
   ////lua_State *L;
-  uv_tcp_t *server;
+  server_t *server;
+};
+
+// how request body is delivered
+enum body_mode {
+  BODY_STREAM = 0, // as it arrives, by 'data' events
+  BODY_BUFFER, // at once, with 'end' event
+  BODY_DISCARD // not at all
 };
 
-uv_tcp_t *server_init(
+// server limits. timeouts are in ms, 0 means none.
+// N.B. connection is closed when a timeout expires
+typedef struct {
+  uint64_t header_timeout; // to receive the request head
+  uint64_t body_timeout; // between request body chunks
+  uint64_t keepalive_timeout; // between requests on idle connection
+  uint64_t handler_timeout; // to respond once the request is received
+  size_t max_header_size; // max size of request URL and headers
+  size_t max_body_size; // max size of request body, 0 means unlimited
+  size_t max_pipeline; // max requests in flight per client, 0 means unlimited
+  int body_mode; // default body delivery mode, see enum body_mode
+  size_t max_buffered_body; // max size of body in BODY_BUFFER mode
+} server_config_t;
+
+typedef void (*msg_free_cb)(msg_t *msg);
+
+struct server_s {
+  uv_tcp_t handle;
+  event_cb on_event;
+  unsigned events; // mask of events to fire, see EVENT_MASK()
+  msg_free_cb on_msg_free; // message is about to be freed
+  server_config_t config;
+  int fast_parser; // try fast parser first, if built with UHTTP_FAST_PARSER
+  void *data; // user data, e.g. Lua handler reference
+};
+
+typedef struct server_threads_s {
+  int port;
+  const char *host;
+  int backlog_size;
+  event_cb on_event;
+  server_config_t config;
+  int nthreads;
+  uv_thread_t threads[0];
+} server_threads_t;
+
+// fill config with defaults
+void server_config_init(server_config_t *config);
+
+// N.B. NULL config means defaults
+
+server_t *server_init(
+    int port,
+    const char *host,
+    int backlog_size,
+    event_cb on_event,
+    const server_config_t *config
+  );
+
+server_t *server_listen(
+    uv_loop_t *loop,
     int port,
     const char *host,
     int backlog_size,
-    event_cb on_event
+    event_cb on_event,
+    int reuseport,
+    const server_config_t *config
+  );
+
+server_t *server_open(
+    uv_loop_t *loop,
+    int fd,
+    int backlog_size,
+    event_cb on_event,
+    const server_config_t *config
   );
 
-void response_write(msg_t *self, const char *data, size_t len);
+server_threads_t *server_init_threads(
+    int port,
+    const char *host,
+    int backlog_size,
+    event_cb on_event,
+    int nthreads,
+    const server_config_t *config
+  );
+
+void server_join_threads(server_threads_t *self);
+
+void wheel_start(uv_loop_t *loop, wheel_timer_t *t, wheel_cb cb,
+    uint64_t timeout);
+void wheel_stop(wheel_timer_t *t);
+
+// lua_Alloc compatible allocator using per-thread size class freelists
+// for objects up to SLAB_MAX bytes. N.B. a state must be used by the
+// thread which created it
+void *slab_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+// stats of the calling thread
+const slab_stats_t *slab_stats(void);
+
+void client_close(client_t *self);
+
+// value of known header by id, NULL if absent
+#define MSG_HEADER(msg, id) \
+  ((msg)->known[id] ? &(msg)->headers[(msg)->known[id] - 1].value : NULL)
+
+int header_id(const char *name, size_t len);
+const char *header_name(int id);
+const uv_buf_t *msg_header(const msg_t *msg, const char *name);
+const uv_buf_t *msg_header_len(const msg_t *msg, const char *name, size_t len);
+
+// stable accessors for bindings. N.B. returned slices are not 0-terminated
+const char *msg_method(const msg_t *msg);
+const char *msg_url(const msg_t *msg, size_t *len);
+int msg_keep_alive(const msg_t *msg);
+size_t msg_nheaders(const msg_t *msg);
+const char *msg_header_name(const msg_t *msg, size_t i, size_t *len);
+const char *msg_header_value(const msg_t *msg, size_t i, size_t *len);
+const char *msg_header_get(
+    const msg_t *msg,
+    const char *name,
+    size_t name_len,
+    size_t *len
+  );
+
+// reason phrases by status code
+extern const char *STATUS_CODES[HTTP_STATUS_MAX];
+
+// appends return -1 if out of memory. N.B. data appended so far is kept
+void rope_init(rope_t *self);
+int rope_append(rope_t *self, const char *data, size_t len);
+// append HTML escaped data
+int rope_append_escaped(rope_t *self, const char *data, size_t len);
+void rope_free(rope_t *self);
+
+// max length of formatted uint64_t
+#define FORMAT_UINT_SIZE 20
+char *format_uint(char *end, uint64_t value);
+
+// "HTTP/1.1 <code> <reason>\r\n", NULL for unknown code
+const uv_buf_t *response_status_line(int code);
+// "Date: <now>\r\n", refreshed every second.
+// N.B. the buffer stays valid for a second after refresh
+const uv_buf_t *response_date(uv_loop_t *loop);
+void response_write_status(msg_t *self, int code);
+void response_write_date(msg_t *self);
+// returns 1 if data is referenced, so it must live until write is done,
+// 0 if it is copied. out of memory closes the connection and returns -1,
+// as bytes can not be dropped once the length of the body is announced
+int response_write(msg_t *self, const char *data, size_t len);
+// write data copying it, e.g. when it can not be kept alive until written.
+// returns -1 if out of memory, the connection is closed then
+int response_write_copy(msg_t *self, const char *data, size_t len);
+// write rope chunks without copying. N.B. the message takes the chunks,
+// the rope is left empty. returns -1 as response_write_copy does
+int response_write_rope(msg_t *self, rope_t *rope);
 void response_end(msg_t *self);
+// give up on the response: answer with code and close the connection if
+// nothing was written yet, else just close the connection
+void response_abort(msg_t *self, int code);
 
 #endif
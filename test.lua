@@ -11,6 +11,7 @@ print('LUV', LUV)
 local RESPONSE_TABLE = {'H','e','llo','\n'}
 local RESPONSE_BODY = ('Hello\n'):rep(1)
 local RESPONSE = "HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\n" .. RESPONSE_BODY
+local HEADERS = LUV.headers{ ['Content-Type'] = 'text/plain' }
 
 local function Message(handle)
   local self = LUV.msg(handle)
@@ -22,14 +23,157 @@ end
 
 local slow = false
 
+-- targeted cases by path, driven by test/early and test/api.
+-- on_request, on_data and on_end are called for the events of the request
+local TESTS = {}
+
+-- answered before the body arrives, the body is then skipped
+TESTS['/early'] = {
+  on_request = function (msg)
+    LUV.body_mode(msg, LUV.BODY_DISCARD)
+    LUV.send(msg, '[555]\n', 200, {})
+  end,
+}
+
+TESTS['/echo'] = {
+  on_request = function (msg) LUV.body_mode(msg, LUV.BODY_BUFFER) end,
+  on_end = function (msg, body)
+    LUV.send(msg, '[' .. body .. ']\n', 200, {})
+  end,
+}
+
+local streamed = {}
+TESTS['/stream'] = {
+  on_request = function (msg) streamed[msg] = 0 end,
+  on_data = function (msg, chunk) streamed[msg] = streamed[msg] + #chunk end,
+  on_end = function (msg)
+    LUV.send(msg, '[stream ' .. streamed[msg] .. ']\n', 200, {})
+    streamed[msg] = nil
+  end,
+}
+
+TESTS['/buffer'] = {
+  on_end = function (msg)
+    local buf = LUV.buffer()
+    buf:append('[', 'buf '):append_int(-42):append(' ')
+    buf:append_escaped('<a&b>'):append(']\n')
+    assert(#buf == 26)
+    LUV.send(msg, buf, 200, {})
+  end,
+}
+
+TESTS['/delay'] = {
+  on_end = function (msg)
+    local ticks = 0
+    -- stopped timer never fires, its slot is reused
+    LUV.delay(5, function () ticks = ticks + 100 end):stop()
+    local timer
+    timer = LUV.delay(0, function ()
+      ticks = ticks + 1
+      if ticks < 3 then return end
+      timer:stop()
+      -- stopping stopped timer is ok
+      timer:stop()
+      LUV.send(msg, '[' .. ticks .. ' ticks]\n', 200, {})
+    end, 5)
+  end,
+}
+
+-- known headers are found by name, empty ones too
+TESTS['/headers'] = {
+  on_end = function (msg)
+    local values = {}
+    for i, name in ipairs({ 'Cookie', 'User-Agent', 'Authorization' }) do
+      values[i] = tostring(LUV.header(msg, name))
+    end
+    LUV.send(msg, '[' .. Table.concat(values, '|') .. ']\n', 200, {})
+  end,
+}
+
+-- N.B. request handlers run in coroutines
+TESTS['/sleep'] = {
+  on_request = function (msg)
+    -- negative is no sleep
+    LUV.sleep(-1)
+    LUV.sleep(10)
+    LUV.send(msg, '[slept]\n', 200, {})
+  end,
+}
+
+TESTS['/read'] = {
+  on_request = function (msg)
+    local body, err = LUV.read_body(msg)
+    LUV.send(msg, '[' .. (body or err) .. ']\n', 200, {})
+  end,
+}
+
+-- part of body is streamed while sleeping, the rest can not be read
+TESTS['/sleep-read'] = {
+  on_request = function (msg)
+    LUV.sleep(500)
+    local body, err = LUV.read_body(msg)
+    LUV.send(msg, '[' .. (body or err) .. ']\n', 200, {})
+  end,
+}
+
+-- N.B. any module will do
+LUV.work_pool('string', 2)
+TESTS['/work'] = {
+  on_request = function (msg)
+    local ok, s = LUV.work('rep', { 'ab', 3 })
+    assert(ok and s == 'ababab')
+    -- error is returned, not raised
+    local failed = LUV.work('nope')
+    LUV.work('upper', { s }, function (ok, s)
+      LUV.send(msg, '[' .. s .. ' ' .. tostring(failed) .. ']\n', 200, {})
+    end)
+  end,
+}
+
+-- runs out of handler_budget, answered 503
+TESTS['/spin'] = {
+  on_request = function (msg)
+    -- N.B. pcall must not swallow the budget error
+    while true do pcall(error, 'swallowed') end
+  end,
+}
+
+-- N.B. loop which would get compiled, were the script not kept off JIT
+TESTS['/loop'] = {
+  on_request = function (msg)
+    while true do end
+  end,
+}
+
+TESTS['/watchdog'] = {
+  on_end = function (msg)
+    local stats = LUV.watchdog_stats()
+    LUV.send(msg, '[' .. stats.offenders[1] .. ']\n', 200, {})
+  end,
+}
+
+-- targeted case the message is for, if any
+local function test_of(msg)
+  local m = LUV.msg(msg)
+  return m and TESTS[m.uri.path]
+end
+
 LUV.make_server(8080, '0.0.0.0', 128, function (msg, ev, int, void)
   --print('EVENT', msg, ev, int, void)
   --local m = Message(msg)
-  if ev == LUV.DATA then
+  if ev == LUV.REQUEST then
+    local test = test_of(msg)
+    if test and test.on_request then test.on_request(msg) end
+  elseif ev == LUV.DATA then
+    local test = test_of(msg)
+    if test and test.on_data then test.on_data(msg, int) end
     --print('DATA', int, void)
   elseif ev == LUV.END then
+    local test = test_of(msg)
     --LUV.delay(10, function ()
-    if not slow then
+    if test then
+      if test.on_end then test.on_end(msg, int) end
+    elseif not slow then
       local m = LUV.msg(msg)
       --for k, v in pairs(m.headers) do print(k, v) end
       if m.uri.path == '/1' then
@@ -41,7 +185,7 @@ LUV.make_server(8080, '0.0.0.0', 128, function (msg, ev, int, void)
       elseif m.uri.path == '/4' then
         LUV.delay(10, function () LUV.send(msg, '[444]\n', 200, {}) end)
       else
-        LUV.delay(1, function () LUV.send(msg, RESPONSE_BODY, 200, {}) end)
+        LUV.delay(1, function () LUV.send(msg, RESPONSE_BODY, 200, HEADERS) end)
         --LUV.send(msg, RESPONSE_BODY, 200, {})
         --LUV.send(msg, RESPONSE_BODY, 200, {})
       end
@@ -59,6 +203,10 @@ LUV.make_server(8080, '0.0.0.0', 128, function (msg, ev, int, void)
   elseif ev == LUV.ERROR then
     print('ERROR', int, void)
   end
-end)
+end, {
+  workers = tonumber(os.getenv('WORKERS')),
+  coroutines = true,
+  handler_budget = 1000000,
+})
 print('Server listening to http://*:8080. CTRL+C to exit.')
 LUV.run()